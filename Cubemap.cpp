@@ -1,4 +1,5 @@
 #include <sys/stat.h>
+#include <algorithm>
 #include <cmath>
 #include <iostream>
 #include <sstream>
@@ -6,6 +7,7 @@
 
 #include "Cubemap"
 #include "Math"
+#include "PrecomputedLightTable"
 
 #include <tbb/parallel_for.h>
 //#include <tbb/task_scheduler_init.h>
@@ -28,21 +30,29 @@ Cubemap::MipLevel::MipLevel() {
     _size = 0;
     for (int i = 0; i < 6; i++) {
         _images[i] = 0;
+        _halfImages[i] = 0;
     }
 }
 
 Cubemap::MipLevel::~MipLevel() {
     for (int i = 0; i < 6; i++) {
         if (_images[i]) delete[] _images[i];
+        if (_halfImages[i]) delete[] _halfImages[i];
     }
 }
 
-void Cubemap::MipLevel::init(uint size, uint sample) {
+void Cubemap::MipLevel::init(uint size, uint sample, bool halfFloat) {
     _size = size;
     _samplePerPixel = sample;
     for (int i = 0; i < 6; i++) {
         if (_images[i]) delete[] _images[i];
-        _images[i] = new float[size * size * sample];
+        if (_halfImages[i]) delete[] _halfImages[i];
+        _images[i] = 0;
+        _halfImages[i] = 0;
+        if (halfFloat)
+            _halfImages[i] = new ushort[size * size * sample];
+        else
+            _images[i] = new float[size * size * sample];
     }
 }
 
@@ -394,7 +404,10 @@ void Cubemap::MipLevel::write(const std::string& filename) const {
     for (int s = 0; s < 6; ++s) {
         ImageSpec spec(_size, _size, _samplePerPixel, TypeDesc::FLOAT);
         out->open(filename, spec, appendmode);
-        out->write_image(TypeDesc::FLOAT, _images[s]);
+        if (isHalfFloat())
+            out->write_image(TypeDesc::HALF, _halfImages[s]);
+        else
+            out->write_image(TypeDesc::FLOAT, _images[s]);
         // Use AppendSubimage mode for subsequent levels
         appendmode = ImageOutput::AppendSubimage;
     }
@@ -406,10 +419,19 @@ void Cubemap::write(const std::string& filename) const {
     _levels[0].write(filename);
 }
 
-bool Cubemap::MipLevel::load(const std::string& name) {
+bool Cubemap::MipLevel::load(const std::string& name, bool halfFloat) {
     ImageInput* input = ImageInput::open(name);
     if (!input) return false;
 
+    // float buffer used to convert faces to half
+    std::vector<float> faceBuffer;
+
+    // precision report of the half conversion
+    double maxRelativeError = 0.0;
+    double sumRelativeError = 0.0;
+    size_t numRelativeError = 0;
+    size_t numClamped = 0;
+
     for (int i = 0; i < 6; i++) {
         ImageSpec spec;
         input->seek_subimage(i, 0, spec);
@@ -421,7 +443,7 @@ bool Cubemap::MipLevel::load(const std::string& name) {
                     << std::endl;
                 return false;
             }
-            init(spec.width, spec.nchannels);
+            init(spec.width, spec.nchannels, halfFloat);
         }
 
         if (spec.width != spec.height && spec.width != getSize()) {
@@ -429,15 +451,54 @@ bool Cubemap::MipLevel::load(const std::string& name) {
                       << std::endl;
             return false;
         }
-        input->read_image(TypeDesc::FLOAT, _images[i]);
+
+        if (!isHalfFloat()) {
+            input->read_image(TypeDesc::FLOAT, _images[i]);
+            continue;
+        }
+
+        const size_t totalFloat =
+            size_t(getSize()) * getSize() * getSamplePerPixel();
+        faceBuffer.resize(totalFloat);
+        input->read_image(TypeDesc::FLOAT, &faceBuffer[0]);
+
+        ushort* dst = _halfImages[i];
+        for (size_t j = 0; j < totalFloat; j++) {
+            float value = faceBuffer[j];
+            // keep energy finite instead of overflowing to infinity
+            if (fabs(value) > HALF_MAX) {
+                value = value > 0.0f ? HALF_MAX : -HALF_MAX;
+                numClamped++;
+            }
+            dst[j] = floatToHalf(value);
+
+            if (fabs(faceBuffer[j]) >= HALF_MIN_NORMAL) {
+                double error = fabs(halfToFloat(dst[j]) - faceBuffer[j]) /
+                               fabs(faceBuffer[j]);
+                maxRelativeError = std::max(maxRelativeError, error);
+                sumRelativeError += error;
+                numRelativeError++;
+            }
+        }
     }
     input->close();
     delete input;
+
+    if (isHalfFloat()) {
+        std::cout << name << " stored as half float, relative error max "
+                  << maxRelativeError << " mean "
+                  << (numRelativeError ? sumRelativeError / numRelativeError
+                                       : 0.0);
+        if (numClamped)
+            std::cout << ", " << numClamped << " values clamped to "
+                      << HALF_MAX;
+        std::cout << std::endl;
+    }
     return true;
 }
 
-bool Cubemap::load(const std::string& filename) {
-    return _levels[0].load(filename);
+bool Cubemap::load(const std::string& filename, bool halfFloat) {
+    return _levels[0].load(filename, halfFloat);
 }
 
 bool fileExist(const std::string& name) {
@@ -445,7 +506,7 @@ bool fileExist(const std::string& name) {
     return (stat(name.c_str(), &buffer) == 0);
 }
 
-bool Cubemap::loadMipMap(const std::string& filenamePattern) {
+bool Cubemap::loadMipMap(const std::string& filenamePattern, bool halfFloat) {
     std::vector<std::string> filenames;
     uint maxMipLevel = 30;  // should be really enough
     char str[512];
@@ -463,17 +524,73 @@ bool Cubemap::loadMipMap(const std::string& filenamePattern) {
 
     _levels.resize(nbMipLevel);
     for (uint i = 0; i < nbMipLevel; i++) {
-        _levels[i].load(filenames[i]);
+        _levels[i].load(filenames[i], halfFloat);
+    }
+
+    return true;
+}
+
+bool Cubemap::buildMipMap() {
+    const uint size = getSize();
+    if (!size || (size & (size - 1))) {
+        std::cout << "can't build mipmap of a " << size << " x " << size
+                  << " cubemap" << std::endl;
+        return false;
     }
 
+    const uint nbMipLevel = log2(size) + 1;
+    const uint samplePerPixel = getSamplePerPixel();
+    const bool halfFloat = _levels[0].isHalfFloat();
+
+    // MipLevel owns its images, move them instead of copying the level
+    std::vector<MipLevel> levels(nbMipLevel);
+    std::swap(levels[0]._size, _levels[0]._size);
+    std::swap(levels[0]._samplePerPixel, _levels[0]._samplePerPixel);
+    std::swap(levels[0]._images, _levels[0]._images);
+    std::swap(levels[0]._halfImages, _levels[0]._halfImages);
+    _levels.swap(levels);
+
+    // 2x2 box filter, texels of a quad have almost the same solid angle
+    for (uint level = 1; level < nbMipLevel; level++) {
+        const MipLevel& src = _levels[level - 1];
+        MipLevel& dst = _levels[level];
+        const uint dstSize = src.getSize() / 2;
+        dst.init(dstSize, samplePerPixel, halfFloat);
+
+        for (uint face = 0; face < 6; face++) {
+            for (uint j = 0; j < dstSize; j++) {
+                for (uint i = 0; i < dstSize; i++) {
+                    Vec3f c0, c1, c2, c3;
+                    src.getTexel(face, 2 * i, 2 * j, c0);
+                    src.getTexel(face, 2 * i + 1, 2 * j, c1);
+                    src.getTexel(face, 2 * i, 2 * j + 1, c2);
+                    src.getTexel(face, 2 * i + 1, 2 * j + 1, c3);
+                    Vec3f color = (c0 + c1 + c2 + c3) * 0.25;
+
+                    const uint index = (j * dstSize + i) * samplePerPixel;
+                    for (uint c = 0; c < samplePerPixel; c++) {
+                        // alpha is not used by the prefilter
+                        float value = c < 3 ? color[c] : 1.0f;
+                        if (halfFloat)
+                            dst._halfImages[face][index + c] =
+                                floatToHalf(value);
+                        else
+                            dst._images[face][index + c] = value;
+                    }
+                }
+            }
+        }
+    }
+
+    std::cout << "built " << nbMipLevel << " mip level - " << size << " x "
+              << size << " cubemap" << std::endl;
     return true;
 }
 
-void Cubemap::computePrefilteredEnvironmentUE4(const std::string& output,
-                                               int startSize, int endSize,
-                                               uint nbSamples,
-                                               uint numRotations,
-                                               const bool fixup) {
+void Cubemap::computePrefilteredEnvironmentUE4(
+    const std::string& output, int startSize, int endSize, uint nbSamples,
+    uint numRotations, const bool fixup,
+    const PrecomputedLightTable* samplesTable, float shRoughnessThreshold) {
     int computeStartSize = startSize;
     if (!computeStartSize) computeStartSize = getSize();
 
@@ -499,6 +616,9 @@ void Cubemap::computePrefilteredEnvironmentUE4(const std::string& output,
 
     float step = (stop - start) * 1.0 / float(endMipMap);
 
+    // projected once and shared by all the levels rougher than the threshold
+    std::vector<double> sh;
+
     for (int i = 0; i < totalMipmap + 1; i++) {
         Cubemap cubemap;
 
@@ -515,12 +635,25 @@ void Cubemap::computePrefilteredEnvironmentUE4(const std::string& output,
         ss << output << "_" << i << ".tif";
 
         // generate debug color cubemap after limit size
-        if (i <= endMipMap) {
+        if (i <= endMipMap && shRoughnessThreshold > 0.0 &&
+            roughnessLinear >= shRoughnessThreshold) {
+            std::cout << "compute level " << i << " with roughness "
+                      << roughnessLinear << " " << size << " x " << size
+                      << " from spherical harmonics to " << ss.str()
+                      << std::endl;
+            if (sh.empty()) {
+                sh.resize(3 * NUM_SH_COEFFICIENT);
+                computeSH(&sh[0]);
+            }
+            cubemap.computeSHCubemapAtLevel(roughnessLinear, *this, &sh[0],
+                                            nbSamples, fixup, samplesTable);
+        } else if (i <= endMipMap) {
             std::cout << "compute level " << i << " with roughness "
                       << roughnessLinear << " " << size << " x " << size
                       << " to " << ss.str() << std::endl;
-            cubemap.computePrefilterCubemapAtLevel(
-                roughnessLinear, *this, nbSamples, numRotations, fixup);
+            cubemap.computePrefilterCubemapAtLevel(roughnessLinear, *this,
+                                                   nbSamples, numRotations,
+                                                   fixup, samplesTable);
         } else {
             cubemap.fill(Vec4f(1.0, 0.0, 1.0, 1.0));
         }
@@ -528,16 +661,31 @@ void Cubemap::computePrefilteredEnvironmentUE4(const std::string& output,
     }
 }
 
-void Cubemap::computePrefilterCubemapAtLevel(float roughnessLinear,
-                                             const Cubemap& inputCubemap,
-                                             uint nbSamples, uint numRotations,
-                                             bool fixup) {
+// use the samples from the table if it contains them or compute them
+static void selectLightSamples(float roughnessLinear, uint nbSamples,
+                               uint size,
+                               const PrecomputedLightTable* samplesTable) {
+    int tableLevel =
+        samplesTable ? samplesTable->findLevel(roughnessLinear, nbSamples, size)
+                     : -1;
+    if (tableLevel >= 0) {
+        usePrecomputedLightInLocalSpace(
+            samplesTable->getSamples(tableLevel), roughnessLinear,
+            samplesTable->getLevel(tableLevel).totalWeight);
+    } else {
+        precomputedLightInLocalSpace(nbSamples, roughnessLinear, size);
+    }
+}
+
+void Cubemap::computePrefilterCubemapAtLevel(
+    float roughnessLinear, const Cubemap& inputCubemap, uint nbSamples,
+    uint numRotations, bool fixup, const PrecomputedLightTable* samplesTable) {
     roughnessLinear = clampTo(roughnessLinear, 0.0f, 1.0f);
 
     if (roughnessLinear == 0.0) nbSamples = 1;
 
-    precomputedLightInLocalSpace(nbSamples, roughnessLinear,
-                                 inputCubemap.getSize());
+    selectLightSamples(roughnessLinear, nbSamples, inputCubemap.getSize(),
+                       samplesTable);
 
     iterateOnFace(0, roughnessLinear, inputCubemap, nbSamples, numRotations,
                   fixup);
@@ -553,6 +701,139 @@ void Cubemap::computePrefilterCubemapAtLevel(float roughnessLinear,
                   fixup);
 }
 
+// project the cubemap on the spherical harmonics, texels are weighted by
+// their solid angle. Only low frequencies are kept so a level around 128 is
+// enough when mipmaps are loaded
+void Cubemap::computeSH(double* sh) const {
+    uint level = 0;
+    while (level + 1 < _levels.size() && _levels[level].getSize() > 128)
+        level++;
+
+    const MipLevel& mipLevel = _levels[level];
+    const uint size = mipLevel.getSize();
+
+    double* SHr = sh;
+    double* SHg = sh + NUM_SH_COEFFICIENT;
+    double* SHb = sh + 2 * NUM_SH_COEFFICIENT;
+    memset(sh, 0, 3 * NUM_SH_COEFFICIENT * sizeof(double));
+
+    double SHdir[NUM_SH_COEFFICIENT];
+    double weightAccum = 0.0;
+
+    for (uint face = 0; face < 6; face++) {
+        for (uint j = 0; j < size; j++) {
+            for (uint i = 0; i < size; i++) {
+                Vec3f direction, color;
+                texelCoordToVectCubeMap(face, float(i), float(j), size,
+                                        &direction[0]);
+                double weight =
+                    texelPixelSolidAngleCubeMap(float(i), float(j), size);
+                mipLevel.getTexel(face, i, j, color);
+
+                EvalSHBasis(&direction[0], SHdir);
+                for (int k = 0; k < NUM_SH_COEFFICIENT; k++) {
+                    SHr[k] += color[0] * SHdir[k] * weight;
+                    SHg[k] += color[1] * SHdir[k] * weight;
+                    SHb[k] += color[2] * SHdir[k] * weight;
+                }
+                weightAccum += weight;
+            }
+        }
+    }
+
+    // the sum of solid angle should be equal to 4 PI
+    for (int k = 0; k < 3 * NUM_SH_COEFFICIENT; k++)
+        sh[k] *= 4.0 * PI / weightAccum;
+
+    std::cout << "projected " << size << " x " << size
+              << " cubemap on spherical harmonics order " << MAX_SH_ORDER
+              << std::endl;
+}
+
+struct SHWorker {
+    uint _samplePerPixel, _size, _face, _fixup;
+    const double* _sh;
+    float* _dataFace;
+
+    SHWorker(uint samplePerPixel, uint size, uint face, bool fixup,
+             const double* sh, float* dataFace)
+        : _samplePerPixel(samplePerPixel),
+          _size(size),
+          _face(face),
+          _fixup(fixup ? 1 : 0),
+          _sh(sh),
+          _dataFace(dataFace) {}
+
+    void operator()(const tbb::blocked_range<uint>& r) const {
+        double SHdir[NUM_SH_COEFFICIENT];
+
+        for (uint j = r.begin(); j != r.end(); ++j) {
+            int lineIndex = j * _samplePerPixel * _size;
+
+            for (uint i = 0; i < _size; i++) {
+                Vec3f direction;
+                int index = lineIndex + i * _samplePerPixel;
+
+                texelCoordToVectCubeMap(_face, float(i), float(j), _size,
+                                        &direction[0], _fixup);
+                EvalSHBasis(&direction[0], SHdir);
+
+                double color[3] = {0.0, 0.0, 0.0};
+                for (int k = 0; k < NUM_SH_COEFFICIENT; k++) {
+                    color[0] += _sh[k] * SHdir[k];
+                    color[1] += _sh[NUM_SH_COEFFICIENT + k] * SHdir[k];
+                    color[2] += _sh[2 * NUM_SH_COEFFICIENT + k] * SHdir[k];
+                }
+
+                // remove the ringing below zero
+                _dataFace[index] = std::max(color[0], 0.0);
+                _dataFace[index + 1] = std::max(color[1], 0.0);
+                _dataFace[index + 2] = std::max(color[2], 0.0);
+            }
+        }
+    }
+};
+
+void Cubemap::computeSHCubemapAtLevel(
+    float roughnessLinear, const Cubemap& inputCubemap, const double* sh,
+    uint nbSamples, bool fixup, const PrecomputedLightTable* samplesTable) {
+    roughnessLinear = clampTo(roughnessLinear, 0.0f, 1.0f);
+
+    selectLightSamples(roughnessLinear, nbSamples, inputCubemap.getSize(),
+                       samplesTable);
+
+    // the prefilter lobe only depends on NoL, so its convolution scales each
+    // band by the mean of the Legendre polynomial over the lobe. It's
+    // estimated with the same samples and NoL weights than the sampling
+    double bandFactor[MAX_SH_ORDER] = {0.0};
+    for (uint i = 0; i < nbSamples; i++) {
+        const double z = getPrecomputedLightInLocalSpace(i)[2];
+        const double z2 = z * z;
+        bandFactor[0] += z;
+        bandFactor[1] += z * z;
+        bandFactor[2] += z * (3.0 * z2 - 1.0) / 2.0;
+        bandFactor[3] += z * (5.0 * z2 - 3.0) * z / 2.0;
+        bandFactor[4] += z * (35.0 * z2 * z2 - 30.0 * z2 + 3.0) / 8.0;
+    }
+
+    std::vector<double> convolvedSH(3 * NUM_SH_COEFFICIENT);
+    for (int l = 0; l < MAX_SH_ORDER; l++) {
+        bandFactor[l] /= getPrecomputedLightTotalWeight();
+        for (int k = l * l; k < (l + 1) * (l + 1); k++) {
+            for (int c = 0; c < 3; c++)
+                convolvedSH[c * NUM_SH_COEFFICIENT + k] =
+                    sh[c * NUM_SH_COEFFICIENT + k] * bandFactor[l];
+        }
+    }
+
+    uint size = getSize();
+    for (uint face = 0; face < 6; face++) {
+        parallel_for(tbb::blocked_range<uint>(0, size),
+                     SHWorker(getSamplePerPixel(), size, face, fixup,
+                              &convolvedSH[0], getImages().imageFace(face)));
+    }
+}
+
 #if 0
 void Cubemap::iterateOnFace( uint face, float roughnessLinear, const Cubemap& cubemap, uint nbSamples, bool fixup, bool backgroundAverage ) {
 
@@ -962,6 +1243,21 @@ void Cubemap::getSampleLOD(float lod, const Vec3f& direction,
     color = lerp(color0, color1, r);
 }
 
+void Cubemap::MipLevel::getTexel(uint face, uint i, uint j,
+                                 Vec3f& color) const {
+    const uint index = (j * getSize() + i) * getSamplePerPixel();
+    if (_halfImages[face]) {
+        const ushort* texel = _halfImages[face] + index;
+        color[0] = halfToFloat(texel[0]);
+        color[1] = halfToFloat(texel[1]);
+        color[2] = halfToFloat(texel[2]);
+    } else {
+        color[0] = _images[face][index];
+        color[1] = _images[face][index + 1];
+        color[2] = _images[face][index + 2];
+    }
+}
+
 void Cubemap::MipLevel::getSample(const Vec3f& direction, Vec3f& color) const {
     float u, v;
     int faceIndex;
@@ -977,9 +1273,17 @@ void Cubemap::MipLevel::getSample(const Vec3f& direction, Vec3f& color) const {
     const long i0 = lrintf(u);
     const long j0 = lrintf(v);
 
-    color[0] = _images[faceIndex][(j0 * size + i0) * getSamplePerPixel()];
-    color[1] = _images[faceIndex][(j0 * size + i0) * getSamplePerPixel() + 1];
-    color[2] = _images[faceIndex][(j0 * size + i0) * getSamplePerPixel() + 2];
+    const long index = (j0 * size + i0) * getSamplePerPixel();
+    if (_halfImages[faceIndex]) {
+        const ushort* texel = _halfImages[faceIndex] + index;
+        color[0] = halfToFloat(texel[0]);
+        color[1] = halfToFloat(texel[1]);
+        color[2] = halfToFloat(texel[2]);
+    } else {
+        color[0] = _images[faceIndex][index];
+        color[1] = _images[faceIndex][index + 1];
+        color[2] = _images[faceIndex][index + 2];
+    }
 
 #else
     // there is no bilinear in because of corner, so keep nearest
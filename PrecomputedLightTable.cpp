@@ -0,0 +1,96 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+#include "PrecomputedLightTable"
+
+PrecomputedLightTable::PrecomputedLightTable() : _data(0), _dataSize(0) {}
+
+PrecomputedLightTable::~PrecomputedLightTable() {
+    if (_data) munmap(_data, _dataSize);
+}
+
+bool PrecomputedLightTable::load(const std::string& filename) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "can't open samples file " << filename << std::endl;
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(Header)) {
+        std::cerr << filename << " is not a samples file" << std::endl;
+        close(fd);
+        return false;
+    }
+
+    void* data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        std::cerr << "can't map samples file " << filename << std::endl;
+        return false;
+    }
+
+    const Header* header = (const Header*)data;
+    if (memcmp(header->magic, "GGXS", 4) != 0 || header->version != VERSION) {
+        std::cerr << filename << " is not a samples file version " << VERSION
+                  << std::endl;
+        munmap(data, st.st_size);
+        return false;
+    }
+
+    size_t expectedSize =
+        sizeof(Header) + header->numLevels * sizeof(Level) +
+        size_t(header->numLevels) * header->numSamples * sizeof(Vec4f);
+    if (size_t(st.st_size) != expectedSize) {
+        std::cerr << filename << " is truncated" << std::endl;
+        munmap(data, st.st_size);
+        return false;
+    }
+
+    if (_data) munmap(_data, _dataSize);
+    _data = data;
+    _dataSize = st.st_size;
+
+    std::cout << "loaded " << getNumLevels() << " levels of " << getNumSamples()
+              << " samples for size " << getSize() << " from " << filename
+              << std::endl;
+    return true;
+}
+
+bool PrecomputedLightTable::write(const std::string& filename, uint numSamples,
+                                  uint size,
+                                  const std::vector<float>& roughnessLinear,
+                                  const std::vector<double>& totalWeight,
+                                  const std::vector<Vec4f>& samples) {
+    FILE* file = fopen(filename.c_str(), "wb");
+    if (!file) {
+        std::cerr << "can't write samples file " << filename << std::endl;
+        return false;
+    }
+
+    Header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "GGXS", 4);
+    header.version = VERSION;
+    header.numSamples = numSamples;
+    header.size = size;
+    header.numLevels = roughnessLinear.size();
+    fwrite(&header, sizeof(header), 1, file);
+
+    for (uint i = 0; i < header.numLevels; i++) {
+        Level level;
+        level.roughnessLinear = roughnessLinear[i];
+        level.reserved = 0.0;
+        level.totalWeight = totalWeight[i];
+        fwrite(&level, sizeof(level), 1, file);
+    }
+
+    fwrite(&samples[0], sizeof(Vec4f), samples.size(), file);
+    fclose(file);
+    return true;
+}
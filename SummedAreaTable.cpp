@@ -1,46 +1,222 @@
 #include "SummedAreaTable"
 #include <cassert>
 
-void SummedAreaTable::createLum(float* rgb, const uint width, const uint height,
-                                const uint nc) {
+#include <tbb/parallel_for.h>
+
+#define ENHANCE_PRECISION 1
+
+// the log field is the log of the luminance plus this fraction of the
+// brightest pixel, so black pixels don't give -inf
+#define LOG_EPSILON 1e-6
+
+// first pass of the summed area table: normalize the pixels and replace each
+// row by its prefix sums, the columns are summed by SatColumnScan.
+// Each field is scanned by its own loop so the loops have no branch.
+struct SatRowScan {
+    uint _width, _stride;
+    double* _table;
+    const uint* _offset;
+    double _normalizer;
+    double _minLum, _rangeLum, _logEpsilon;
+    double _minR, _rangeR, _minG, _rangeG, _minB, _rangeB;
+
+    bool has(SummedAreaTable::Field field) const {
+        return _offset[field] < _stride;
+    }
+
+    // prefix sum of values in a field of the row
+    void scan(double* row, const double* values,
+              SummedAreaTable::Field field) const {
+        double* dst = row + _offset[field];
+        double sum = 0.0;
+        for (uint x = 0; x < _width; ++x) {
+            sum += values[x];
+            dst[x * _stride] = sum;
+        }
+    }
+
+    // values of a color field, scaled to [0.0, 0.5]
+    void color(const double* row, double* values, SummedAreaTable::Field field,
+               double min, double range) const {
+        const double* src = row + _offset[field];
+        for (uint x = 0; x < _width; ++x) {
+            double value = src[x * _stride];
+#ifdef ENHANCE_PRECISION
+            value = ((value - min) / range) * 0.5;
+#endif
+            values[x] = value;
+        }
+    }
+
+    void operator()(const tbb::blocked_range<uint>& r) const {
+        std::vector<double> lum(_width), values(_width);
+
+        for (uint y = r.begin(); y != r.end(); ++y) {
+            double* row = _table + size_t(y) * _width * _stride;
+
+            const double* src = row + _offset[SummedAreaTable::FIELD_LUM];
+            for (uint x = 0; x < _width; ++x)
+                lum[x] = src[x * _stride] * _normalizer;
+
+            // integral log, of the luminance before it's shifted to the
+            // precision range where the darkest pixel is 0
+            if (has(SummedAreaTable::FIELD_LOG)) {
+                for (uint x = 0; x < _width; ++x)
+                    values[x] = log(std::max(lum[x], 0.0) + _logEpsilon);
+                scan(row, &values[0], SummedAreaTable::FIELD_LOG);
+            }
+
+#ifdef ENHANCE_PRECISION
+            for (uint x = 0; x < _width; ++x)
+                lum[x] = ((lum[x] - _minLum) / _rangeLum) * 0.5;
+#endif
+            scan(row, &lum[0], SummedAreaTable::FIELD_LUM);
+
+            if (has(SummedAreaTable::FIELD_R)) {
+                color(row, &values[0], SummedAreaTable::FIELD_R, _minR,
+                      _rangeR);
+                scan(row, &values[0], SummedAreaTable::FIELD_R);
+                color(row, &values[0], SummedAreaTable::FIELD_G, _minG,
+                      _rangeG);
+                scan(row, &values[0], SummedAreaTable::FIELD_G);
+                color(row, &values[0], SummedAreaTable::FIELD_B, _minB,
+                      _rangeB);
+                scan(row, &values[0], SummedAreaTable::FIELD_B);
+            }
+
+            // Integral image of higher power
+            // http://vision.okstate.edu/pubs/ssiai_tp_1.pdf
+            if (has(SummedAreaTable::FIELD_POW2)) {
+                for (uint x = 0; x < _width; ++x) values[x] = lum[x] * lum[x];
+                scan(row, &values[0], SummedAreaTable::FIELD_POW2);
+            }
+            if (has(SummedAreaTable::FIELD_POW3)) {
+                for (uint x = 0; x < _width; ++x)
+                    values[x] = lum[x] * lum[x] * lum[x];
+                scan(row, &values[0], SummedAreaTable::FIELD_POW3);
+            }
+            if (has(SummedAreaTable::FIELD_POW4)) {
+                for (uint x = 0; x < _width; ++x) {
+                    const double lum2 = lum[x] * lum[x];
+                    values[x] = lum2 * lum2;
+                }
+                scan(row, &values[0], SummedAreaTable::FIELD_POW4);
+            }
+            if (has(SummedAreaTable::FIELD_POW5)) {
+                for (uint x = 0; x < _width; ++x) {
+                    const double lum2 = lum[x] * lum[x];
+                    values[x] = lum2 * lum2 * lum[x];
+                }
+                scan(row, &values[0], SummedAreaTable::FIELD_POW5);
+            }
+        }
+    }
+};
+
+// first pass of the fixed point table: the pixels rounded to integers and
+// summed along the rows, there is no rounding in the sums
+struct ExactRowScan {
+    const float* _rgb;
+    uint _width, _height, _nc;
+    double _weight;
+    const double* _solidAngles;
+    const double* _scale;
+    int64_t* _table;
+
+    void operator()(const tbb::blocked_range<uint>& r) const {
+        for (uint y = r.begin(); y != r.end(); ++y) {
+            // same solid angle than the luminance table
+            const double posY = (double)(y + 1.0) / (double)(_height + 1.0);
+            double solidAngle = cos(PI * (posY - 0.5)) * _weight;
+
+            int64_t* row =
+                _table + size_t(y) * _width * SummedAreaTable::EXACT_COUNT;
+            int64_t sums[SummedAreaTable::EXACT_COUNT] = {0, 0, 0, 0};
+
+            for (uint x = 0; x < _width; ++x) {
+                if (_solidAngles)
+                    solidAngle = _solidAngles[size_t(y) * _width + x];
+
+                const float* pixel = _rgb + (size_t(y) * _width + x) * _nc;
+                const double r = pixel[0];
+                const double g = pixel[1];
+                const double b = pixel[2];
+                const double values[SummedAreaTable::EXACT_COUNT] = {
+                    luminance(r, g, b) * solidAngle, r, g, b};
+
+                for (uint f = 0; f < SummedAreaTable::EXACT_COUNT; ++f) {
+                    const double v = values[f] * _scale[f];
+                    sums[f] += int64_t(v < 0.0 ? v - 0.5 : v + 0.5);
+                    row[x * SummedAreaTable::EXACT_COUNT + f] = sums[f];
+                }
+            }
+        }
+    }
+};
+
+// second pass: add each row to the next one, by blocks of columns.
+// The records are contiguous so the inner loop sums all the fields at once
+// and is vectorized.
+template <typename T>
+struct SatColumnScan {
+    uint _width, _height, _stride;
+    T* _table;
+
+    SatColumnScan(uint width, uint height, uint stride, T* table)
+        : _width(width), _height(height), _stride(stride), _table(table) {}
+
+    void operator()(const tbb::blocked_range<uint>& r) const {
+        const size_t k0 = size_t(r.begin()) * _stride;
+        const size_t k1 = size_t(r.end()) * _stride;
+        const size_t rowSize = size_t(_width) * _stride;
+
+        for (uint y = 1; y < _height; ++y) {
+            T* row = _table + y * rowSize;
+            const T* previous = row - rowSize;
+#pragma omp simd
+            for (size_t k = k0; k < k1; ++k) row[k] += previous[k];
+        }
+    }
+};
+
+void SummedAreaTable::create(float* rgb, const uint width, const uint height,
+                             const uint nc, const uint moments,
+                             const double* solidAngles) {
     assert(nc > 2);
 
     _width = width;
     _height = height;
+    _moments = moments | MOMENT_LUM;
 
     const uint imgSize = width * height;
 
-    _sat.clear();
-    _sat.resize(imgSize);
-    _sat1.clear();
-    _sat1.resize(imgSize);
-    _sat2.clear();
-    _sat2.resize(imgSize);
-    _sat3.clear();
-    _sat3.resize(imgSize);
-    _sat4.clear();
-    _sat4.resize(imgSize);
-    _sat5.clear();
-    _sat5.resize(imgSize);
-
-    _r.clear();
-    _r.resize(imgSize);
-    _g.clear();
-    _g.resize(imgSize);
-    _b.clear();
-    _b.resize(imgSize);
-
-    _sat[0] = 0.0;
-    _sat1[0] = 0.0;
-    _sat2[0] = 0.0;
-    _sat3[0] = 0.0;
-    _sat4[0] = 0.0;
-    _sat5[0] = 0.0;
-    _r[0] = 0.0;
-    _g[0] = 0.0;
-    _b[0] = 0.0;
+    // records only have the fields of the moments, in the Field order
+    const bool colors = _moments & MOMENT_RGB;
+    const bool fields[FIELD_COUNT] = {
+        true,
+        colors,
+        colors,
+        colors,
+        (_moments & MOMENT_LOG) != 0,
+        (_moments & MOMENT_POW2) != 0,
+        (_moments & MOMENT_POW3) != 0,
+        (_moments & MOMENT_POW4) != 0,
+        (_moments & MOMENT_POW5) != 0};
+
+    uint numFields = 0;
+    for (uint f = 0; f < FIELD_COUNT; ++f) numFields += fields[f];
+
+    _stride = numFields <= 2 ? numFields
+                             : numFields <= 4 ? 4 : numFields <= 8 ? 8 : 16;
+
+    for (uint f = 0, offset = 0; f < FIELD_COUNT; ++f)
+        _offset[f] = fields[f] ? offset++ : _stride;
+
+    _table.clear();
+    _table.resize(size_t(imgSize) * _stride, 0.0);
 
     double weightAccum = 0.0;
+    double exactBounds[EXACT_COUNT] = {0.0, 0.0, 0.0, 0.0};
 
     // solid angle for 1 pixel on equi map
     double weight = (4.0 * PI) / ((double)(imgSize));
@@ -55,7 +231,7 @@ void SummedAreaTable::createLum(float* rgb, const uint width, const uint height,
     _maxPonderedLum = DBL_MIN;
     _minR = DBL_MAX;
     _maxR = DBL_MIN;
-    _minB = DBL_MAX;
+    _minG = DBL_MAX;
     _maxG = DBL_MIN;
     _minB = DBL_MAX;
     _maxB = DBL_MIN;
@@ -68,11 +244,14 @@ void SummedAreaTable::createLum(float* rgb, const uint width, const uint height,
         // the poles. To compensate for this, the pixels of the probe image
         // should first be scaled by cosφ.
         // (φ == 0 at middle height of image input)
-        const double solidAngle = cos(PI * (posY - 0.5)) * weight;
+        double solidAngle = cos(PI * (posY - 0.5)) * weight;
 
         for (uint x = 0; x < width; ++x) {
             const uint i = y * width + x;
 
+            // the cubemap texels have their own solid angle
+            if (solidAngles) solidAngle = solidAngles[i];
+
             double r = rgb[i * nc + 0];
             double g = rgb[i * nc + 1];
             double b = rgb[i * nc + 2];
@@ -92,6 +271,12 @@ void SummedAreaTable::createLum(float* rgb, const uint width, const uint height,
             _minB = std::min(b, _minB);
             _maxB = std::max(b, _maxB);
 
+            // magnitude of the fixed point table values
+            exactBounds[EXACT_LUM] += fabs(ixy) * solidAngle;
+            exactBounds[EXACT_R] += fabs(r);
+            exactBounds[EXACT_G] += fabs(g);
+            exactBounds[EXACT_B] += fabs(b);
+
 #define _PONDER_REAL
 #ifdef _PONDER_REAL
 
@@ -131,11 +316,17 @@ void SummedAreaTable::createLum(float* rgb, const uint width, const uint height,
 
 #endif
 
-            _sat[i] = ixy;
+            double* record = &_table[size_t(i) * _stride];
+            record[_offset[FIELD_LUM]] = ixy;
+
+            _minPonderedLum = std::min(ixy, _minPonderedLum);
+            _maxPonderedLum = std::max(ixy, _maxPonderedLum);
 
-            _r[i] = r;
-            _g[i] = g;
-            _b[i] = b;
+            if (colors) {
+                record[_offset[FIELD_R]] = r;
+                record[_offset[FIELD_G]] = g;
+                record[_offset[FIELD_B]] = b;
+            }
 
             // weightAccum += weight;
             // weightAccum += 1.0;
@@ -146,101 +337,73 @@ void SummedAreaTable::createLum(float* rgb, const uint width, const uint height,
     // store for later use.
     _weightAccum = weightAccum;
 
-    bool normalize = true;
+    // a face is normalized with the other faces by the caller
+    bool normalize = !solidAngles;
 
-    if (normalize) {
-        // normalize in order our image Accumulation exactly match 4 PI.
-        const double normalizer = (4.0 * PI) / weightAccum;
+    // normalize in order our image Accumulation exactly match 4 PI.
+    // The scale is positive so it keeps the min and max pixels.
+    const double normalizer = normalize ? (4.0 * PI) / weightAccum : 1.0;
 
+    if (normalize) {
         _sum *= normalizer;
-
-        for (uint i = 0; i < imgSize; ++i) {
-            _sat[i] *= normalizer;
-
-            _minPonderedLum = std::min(_sat[i], _minPonderedLum);
-            _maxPonderedLum = std::max(_sat[i], _maxPonderedLum);
-        }
+        _minPonderedLum *= normalizer;
+        _maxPonderedLum *= normalizer;
     }
 
-#define ENHANCE_PRECISION 1
-#ifdef ENHANCE_PRECISION
+    SatRowScan rows;
+    rows._width = width;
+    rows._stride = _stride;
+    rows._table = &_table[0];
+    rows._offset = _offset;
+    rows._normalizer = normalizer;
 
     // enhances precision of SAT
     // make values be around [0.0, 0.5]
     // https://developer.amd.com/wordpress/media/2012/10/SATsketch-siggraph05.pdf
-    const double rangeLum = _maxLum - _minLum;
-    const double rangePonderedLum = _maxPonderedLum - _minPonderedLum;
-    const double rangeR = _maxR - _minR;
-    const double rangeG = _maxG - _minG;
-    const double rangeB = _maxB - _minB;
-
-    for (uint i = 0; i < imgSize; ++i) {
-        _sat[i] = ((_sat[i] - _minPonderedLum) / rangePonderedLum) * 0.5;
-
-        _r[i] = ((_r[i] - _minR) / rangeR) * 0.5;
-        _g[i] = ((_g[i] - _minG) / rangeG) * 0.5;
-        _b[i] = ((_b[i] - _minB) / rangeB) * 0.5;
-    }
-#endif
-
-    // now we sum
-    for (uint y = 0; y < height; ++y) {
-        for (uint x = 0; x < width; ++x) {
-            const uint i = y * width + x;
-
-            // https://en.wikipedia.org/wiki/Summed_area_table
-            _sat[i] = _sat[i] + I(x - 1, y) + I(x, y - 1) - I(x - 1, y - 1);
-
-            _r[i] = _r[i] + R(x - 1, y) + R(x, y - 1) - R(x - 1, y - 1);
-            _g[i] = _g[i] + G(x - 1, y) + G(x, y - 1) - G(x - 1, y - 1);
-            _b[i] = _b[i] + B(x - 1, y) + B(x, y - 1) - B(x - 1, y - 1);
-        }
-    }
-
-    // integral log
-    for (uint y = 0; y < _height; ++y) {
-        for (uint x = 0; x < _width; ++x) {
-            const uint i = y * width + x;
-
-            double sum = I(x, y);
-            if (sum > 0) sum = log(I(x, y));
-
-            _sat1[i] = sum + I1(x - 1, y) + I1(x, y - 1) - I1(x - 1, y - 1);
-        }
-    }
-
-    // Integral image of higher power
-    // http://vision.okstate.edu/pubs/ssiai_tp_1.pdf
-    // integral 2
-    for (uint y = 0; y < _height; ++y) {
-        for (uint x = 0; x < _width; ++x) {
-            const uint i = y * width + x;
-            _sat2[i] = I(x, y) * I(x, y) + I2(x - 1, y) + I2(x, y - 1) -
-                       I2(x - 1, y - 1);
-        }
-    }
-    // integral 3
-    for (uint y = 0; y < _height; ++y) {
-        for (uint x = 0; x < _width; ++x) {
-            const uint i = y * width + x;
-            _sat3[i] = I(x, y) * I(x, y) * I(x, y) + I3(x - 1, y) +
-                       I3(x, y - 1) - I3(x - 1, y - 1);
-        }
-    }
-    // integral 4
-    for (uint y = 0; y < _height; ++y) {
-        for (uint x = 0; x < _width; ++x) {
-            const uint i = y * width + x;
-            _sat4[i] = I(x, y) * I(x, y) * I(x, y) * I(x, y) + I4(x - 1, y) +
-                       I4(x, y - 1) - I4(x - 1, y - 1);
-        }
-    }
-    // integral 5
-    for (uint y = 0; y < _height; ++y) {
-        for (uint x = 0; x < _width; ++x) {
-            const uint i = y * width + x;
-            _sat5[i] = I(x, y) * I(x, y) * I(x, y) * I(x, y) + I5(x - 1, y) +
-                       I5(x, y - 1) - I5(x - 1, y - 1);
-        }
+    rows._minLum = _minPonderedLum;
+    rows._rangeLum = _maxPonderedLum - _minPonderedLum;
+    rows._logEpsilon =
+        std::max(_maxPonderedLum, 0.0) * LOG_EPSILON + DBL_MIN;
+    rows._minR = _minR;
+    rows._rangeR = _maxR - _minR;
+    rows._minG = _minG;
+    rows._rangeG = _maxG - _minG;
+    rows._minB = _minB;
+    rows._rangeB = _maxB - _minB;
+
+    // https://en.wikipedia.org/wiki/Summed_area_table
+    // rows then columns prefix sums, each pass is parallel
+    tbb::parallel_for(tbb::blocked_range<uint>(0, height), rows);
+    tbb::parallel_for(
+        tbb::blocked_range<uint>(0, width, 64),
+        SatColumnScan<double>(width, height, _stride, &_table[0]));
+
+    if (_moments & MOMENT_EXACT) {
+        _exact.clear();
+        _exact.resize(size_t(imgSize) * EXACT_COUNT);
+
+        // the scales map the sum of the magnitudes of the whole image to
+        // 2^61, so no sum can overflow even with the rounding of the pixels
+        for (uint f = 0; f < EXACT_COUNT; ++f)
+            _exactScale[f] = exactBounds[f] > 0.0
+                                 ? ldexp(1.0, 61) / exactBounds[f]
+                                 : 1.0;
+
+        ExactRowScan exact;
+        exact._rgb = rgb;
+        exact._width = width;
+        exact._height = height;
+        exact._nc = nc;
+        exact._weight = weight;
+        exact._solidAngles = solidAngles;
+        exact._scale = _exactScale;
+        exact._table = &_exact[0];
+
+        tbb::parallel_for(tbb::blocked_range<uint>(0, height), exact);
+        tbb::parallel_for(
+            tbb::blocked_range<uint>(0, width, 64),
+            SatColumnScan<int64_t>(width, height, EXACT_COUNT, &_exact[0]));
+    } else {
+        std::vector<int64_t>().swap(_exact);
     }
 }
@@ -3,6 +3,9 @@
 #include "SummedAreaTableRegion"
 #include "SummedAreaTable"
 
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_reduce.h>
+
 /**
  * A subregion in a SummedAreaTable.
  */
@@ -40,27 +43,186 @@ void SatRegion::create(const int x, const int y, const uint w, const uint h,
     _h = h;
     _sat = sat;
 
-    _sum = _sat->sum(x, y, x + (w - 1), y, x + (w - 1), y + (h - 1), x,
-                     y + (h - 1));
+    const int x1 = x + (w - 1);
+    const int y1 = y + (h - 1);
+
+    // all the moments from the 4 corner records, 0 if they were not built
+    double sums[SummedAreaTable::FIELD_COUNT];
+    _sat->regionSums(x, y, x1, y1, sums);
+
+    _sum = sums[SummedAreaTable::FIELD_LUM];
+    _r = sums[SummedAreaTable::FIELD_R];
+    _g = sums[SummedAreaTable::FIELD_G];
+    _b = sums[SummedAreaTable::FIELD_B];
+    _sum1 = sums[SummedAreaTable::FIELD_LOG];
+    _sum2 = sums[SummedAreaTable::FIELD_POW2];
+    _sum3 = sums[SummedAreaTable::FIELD_POW3];
+    _sum4 = sums[SummedAreaTable::FIELD_POW4];
+    _sum5 = sums[SummedAreaTable::FIELD_POW5];
+}
+
 
-    _r = _sat->sumR(x, y, x + (w - 1), y, x + (w - 1), y + (h - 1), x,
-                    y + (h - 1));
+void SatRegion::split_w(SatRegion& A) const {
+    const int y1 = _y + (_h - 1);
 
-    _g = _sat->sumG(x, y, x + (w - 1), y, x + (w - 1), y + (h - 1), x,
-                    y + (h - 1));
+    // smallest width with at least half the energy, the whole width otherwise
+    int lo = 1;
+    int hi = _w;
+    while (lo < hi) {
+        const int w = (lo + hi) / 2;
+        const int x1 = _x + (w - 1);
 
-    _b = _sat->sumB(x, y, x + (w - 1), y, x + (w - 1), y + (h - 1), x,
-                    y + (h - 1));
+        // if region left has approximately half the energy of the entire
+        // thing stahp
+        if (_sat->sum(_x, _y, x1, _y, x1, y1, _x, y1) * 2.0 >= getSum())
+            hi = w;
+        else
+            lo = w + 1;
+    }
+
+    A.create(_x, _y, lo, _h, _sat);
+}
 
-    _sum2 = _sat->sum2(x, y, x + (w - 1), y, x + (w - 1), y + (h - 1), x,
-                       y + (h - 1));
+void SatRegion::split_h(SatRegion& A) const {
+    const int x1 = _x + (_w - 1);
+
+    // smallest height with at least half the energy, the whole height
+    // otherwise
+    int lo = 1;
+    int hi = _h;
+    while (lo < hi) {
+        const int h = (lo + hi) / 2;
+        const int y1 = _y + (h - 1);
+
+        // if region top has approximately half the energy of the entire
+        // thing stahp
+        if (_sat->sum(_x, _y, x1, _y, x1, y1, _x, y1) * 2.0 >= getSum())
+            hi = h;
+        else
+            lo = h + 1;
+    }
+
+    A.create(_x, _y, _w, lo, _sat);
+}
 
-    _sum3 = _sat->sum3(x, y, x + (w - 1), y, x + (w - 1), y + (h - 1), x,
-                       y + (h - 1));
+/**
+ * Split candidates of a region for the variance minimisation, a split at k
+ * makes the regions A of size k and B of size (size - k) as the median cut.
+ * The split potentials are computed from the tables without building the
+ * regions, and the log values of the corners that don't move with the split
+ * are read once.
+ */
+struct VarianceSplit {
+    const SummedAreaTable* _sat;
+    int _x, _y, _w, _h;
+    bool _vertical;
+
+    // fixed corners of A and B
+    double _a0, _a1, _b0, _b1;
+
+    VarianceSplit(const SatRegion& r, bool vertical)
+        : _sat(r._sat),
+          _x(r._x),
+          _y(r._y),
+          _w(r._w),
+          _h(r._h),
+          _vertical(vertical) {
+        _a0 = _sat->I1(_x, _y);
+        if (_vertical) {
+            _a1 = _sat->I1(_x + _w, _y);
+            _b0 = _sat->I1(_x, _y + _h - 1);
+            _b1 = _sat->I1(_x + _w, _y + _h - 1);
+        } else {
+            _a1 = _sat->I1(_x, _y + _h);
+            _b0 = _sat->I1(_x + _w - 1, _y);
+            _b1 = _sat->I1(_x + _w - 1, _y + _h);
+        }
+    }
+
+    // SatRegion::splitPotential of the region with its 4 corner log values
+    double potential(int x, int y, int w, int h, double f0, double f1,
+                     double f2, double f3) const {
+        const double fav = _sat->I1(int(x + w * 0.5), int(y + h * 0.5));
+
+        f0 -= fav;
+        f1 -= fav;
+        f2 -= fav;
+        f3 -= fav;
+        const double deviation =
+            0.5 * sqrt(f0 * f0 + f1 * f1 + f2 * f2 + f3 * f3);
+
+        const int x1 = x + (w - 1);
+        const int y1 = y + (h - 1);
+        const double sum = _sat->sum(x, y, x1, y, x1, y1, x, y1);
+
+        return deviation * sum * double(w * h);
+    }
+
+    // maximum of the two sub-regions' potentials
+    double operator()(int k) const {
+        double a, b;
+        if (_vertical) {
+            const int by = _y + k - 1;
+            a = potential(_x, _y, _w, k, _a0, _a1, _sat->I1(_x, _y + k),
+                          _sat->I1(_x + _w, _y + k));
+            b = potential(_x, by, _w, _h - k, _b0, _b1, _sat->I1(_x, by),
+                          _sat->I1(_x + _w, by));
+        } else {
+            const int bx = _x + k - 1;
+            a = potential(_x, _y, k, _h, _a0, _a1, _sat->I1(_x + k, _y),
+                          _sat->I1(_x + k, _y + _h));
+            b = potential(bx, _y, _w - k, _h, _b0, _b1, _sat->I1(bx, _y),
+                          _sat->I1(bx, _y + _h));
+        }
+        return std::max(a, b);
+    }
+};
+
+// smallest split value, the first split wins ties so the result doesn't
+// depend on the scheduling
+struct VarianceSplitReduce {
+    const VarianceSplit& _split;
+    double _value;
+    int _k;
+
+    VarianceSplitReduce(const VarianceSplit& split)
+        : _split(split), _value(DBL_MAX), _k(-1) {}
+    VarianceSplitReduce(VarianceSplitReduce& r, tbb::split)
+        : _split(r._split), _value(DBL_MAX), _k(-1) {}
+
+    // NaN potentials are never selected
+    void select(double value, int k) {
+        if (value < _value || (value == _value && k < _k)) {
+            _value = value;
+            _k = k;
+        }
+    }
+
+    void operator()(const tbb::blocked_range<int>& r) {
+        for (int k = r.begin(); k != r.end(); ++k) select(_split(k), k);
+    }
+
+    void join(const VarianceSplitReduce& r) {
+        if (r._k >= 0) select(r._value, r._k);
+    }
+};
+
+// the split of a region of size 2 or more, both halves are not empty
+static int varianceSplit(const SatRegion& r, bool vertical) {
+    const int size = vertical ? r._h : r._w;
+    const VarianceSplit split(r, vertical);
+
+    VarianceSplitReduce reduce(split);
+    tbb::parallel_reduce(tbb::blocked_range<int>(1, size, 64), reduce);
+
+    // no finite potential, cut in the middle
+    return reduce._k >= 0 ? reduce._k : size / 2;
+}
 
-    _sum4 = _sat->sum4(x, y, x + (w - 1), y, x + (w - 1), y + (h - 1), x,
-                       y + (h - 1));
+void SatRegion::varianceSplit_w(SatRegion& A) const {
+    A.create(_x, _y, varianceSplit(*this, false), _h, _sat);
+}
 
-    _sum5 = _sat->sum5(x, y, x + (w - 1), y, x + (w - 1), y + (h - 1), x,
-                       y + (h - 1));
+void SatRegion::varianceSplit_h(SatRegion& A) const {
+    A.create(_x, _y, _w, varianceSplit(*this, true), _sat);
 }
@@ -8,7 +8,7 @@
 static int usage(const std::string& name) {
     std::cerr << "Usage: " << name
               << " [-s size] [-n nbsamples] [-r numRotations] [-b blur angle ] "
-                 "[-f toggle fixup edge ] in.tif out.tif"
+                 "[-f toggle fixup edge ] [-h half float input] in.tif out.tif"
               << std::endl;
     return 1;
 }
@@ -20,8 +20,9 @@ int main(int argc, char* argv[]) {
     int fixup = 0;
     int numRotations = 18;
     float blur = 0.1;
+    bool halfFloat = false;
 
-    while ((c = getopt(argc, argv, "s:n:r:b:f")) != -1) switch (c) {
+    while ((c = getopt(argc, argv, "s:n:r:b:fh")) != -1) switch (c) {
             case 's':
                 size = atoi(optarg);
                 break;
@@ -37,6 +38,9 @@ int main(int argc, char* argv[]) {
             case 'f':
                 fixup = 1;
                 break;
+            case 'h':
+                halfFloat = true;
+                break;
 
             default:
                 return usage(argv[0]);
@@ -49,7 +53,7 @@ int main(int argc, char* argv[]) {
         output = std::string(argv[optind + 1]);
 
         Cubemap image;
-        image.load(input);
+        image.load(input, halfFloat);
         image.computeBackground(output, size, samples, numRotations, blur,
                                 fixup);
 
@@ -4,11 +4,13 @@
 #include <iostream>
 
 #include "Cubemap"
+#include "PrecomputedLightTable"
 
 static int usage(const std::string& name) {
     std::cerr << "Usage: " << name
               << " [-s size] [-e stopSize] [-n nbsamples] [-r numRotations] "
-                 "[-f fixup flag ] in.tif out.tif"
+                 "[-f fixup flag ] [-h half float input] [-c samplesGGX file] "
+                 "[-t sh roughness threshold] in.tif out.tif"
               << std::endl;
     return 1;
 }
@@ -20,8 +22,11 @@ int main(int argc, char* argv[]) {
     int samples = 1024;
     int numRotations = 18;
     int fixup = 0;
+    bool halfFloat = false;
+    std::string samplesFile;
+    float shRoughnessThreshold = 0.0;
 
-    while ((c = getopt(argc, argv, "s:r:e:n:f")) != -1) switch (c) {
+    while ((c = getopt(argc, argv, "s:r:e:n:fhc:t:")) != -1) switch (c) {
             case 's':
                 size = atoi(optarg);
                 break;
@@ -37,6 +42,15 @@ int main(int argc, char* argv[]) {
             case 'f':
                 fixup = 1;
                 break;
+            case 'h':
+                halfFloat = true;
+                break;
+            case 'c':
+                samplesFile = optarg;
+                break;
+            case 't':
+                shRoughnessThreshold = atof(optarg);
+                break;
 
             default:
                 return usage(argv[0]);
@@ -52,12 +66,19 @@ int main(int argc, char* argv[]) {
 
         // check if we can load mipmap
         if (input.find("%") != std::string::npos)
-            image.loadMipMap(input);
-        else
-            image.load(input);
+            image.loadMipMap(input, halfFloat);
+        else if (image.load(input, halfFloat))
+            image.buildMipMap();
+
+        // samples not found in the table are computed
+        PrecomputedLightTable samplesTable;
+        if (!samplesFile.empty() && !samplesTable.load(samplesFile))
+            return 1;
 
         image.computePrefilteredEnvironmentUE4(output, size, endSize, samples,
-                                               numRotations, fixup);
+                                               numRotations, fixup,
+                                               &samplesTable,
+                                               shRoughnessThreshold);
 
     } else {
         return usage(argv[0]);
@@ -19,27 +19,46 @@
 /* DEALINGS IN THE SOFTWARE.                                                  */
 
 #include <assert.h>
+#include <fcntl.h>
+#include <float.h>
 #include <getopt.h>
 #include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <tiffio.h>
+#include <unistd.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <OpenImageIO/imageio.h>
 
+#include "Half"
 #include "gray.h"
 #include "sRGB.h"
 
+OIIO_NAMESPACE_USING
+
 /*----------------------------------------------------------------------------*/
 
 /* In image structure represents an input or output raster.                   */
 
+struct stream;
+
 struct image {
-    float *p;  // data
-    int h;     // height
-    int w;     // width
-    int c;     // sample count
-    int b;     // sample depth
-    int s;     // sample format
+    float *p;          // data
+    int h;             // height
+    int w;             // width
+    int c;             // sample count
+    int b;             // sample depth
+    int s;             // sample format
+    struct stream *t;  // rows read on demand instead of data, see stream
+    struct remap *r;   // precomputed source samples of a destination
 };
 
 typedef struct image image;
@@ -55,7 +74,7 @@ typedef struct point point;
 
 struct pattern {
     int n;
-    point *p;
+    const point *p;
 };
 
 typedef struct pattern pattern;
@@ -127,110 +146,170 @@ static void line(void *dst, int dw, int dx, int dy, int ddx, int ddy,
 #endif
 /*----------------------------------------------------------------------------*/
 
-/* Read one scanline from the given TIFF file, converting it from the format */
-/* of the TIFF to float. The file must have contiguous planar configuration.  */
-/* This is a drop-in replacement for TIFFReadScanline.                        */
-
-int TIFFReadFloatScanline(TIFF *T, float *dst, uint32 r) {
-    static tdata_t *src = NULL;
-    static tsize_t len = 0;
-
-    uint32 w = 0;
-    uint16 c = 0;
-    uint16 b = 0;
-    uint16 s = 0;
-    uint16 p = 0;
-
-    TIFFGetField(T, TIFFTAG_IMAGEWIDTH, &w);
-    TIFFGetField(T, TIFFTAG_SAMPLESPERPIXEL, &c);
-    TIFFGetField(T, TIFFTAG_BITSPERSAMPLE, &b);
-    TIFFGetField(T, TIFFTAG_SAMPLEFORMAT, &s);
-    TIFFGetField(T, TIFFTAG_PLANARCONFIG, &p);
-
-    if (p == PLANARCONFIG_CONTIG) {
-        if (len != TIFFScanlineSize(T)) {
-            len = TIFFScanlineSize(T);
-            src = (void **)realloc(src, len);
-        }
+/* The sample layout of a TIFF directory, read once per page instead of per */
+/* scanline.                                                                  */
+
+#define STRIP_ROWS 16      // rows per strip of the written files
+#define STRIP_ROWS_MAX 256  // larger strips are read by scanline
+
+struct format {
+    uint32 w;    // width
+    uint32 h;    // height
+    uint16 c;    // sample count
+    uint16 b;    // sample depth
+    uint16 s;    // sample format
+    uint16 p;    // planar configuration
+    uint32 rps;  // rows per strip
+    int tiled;
+};
 
-        if (src && TIFFReadScanline(T, src, r, 0) > 0) {
-            if ((b == 8) && (s == SAMPLEFORMAT_UINT || s == 0))
-                for (uint32 i = 0; i < w * c; i++)
-                    dst[i] = ((uint8 *)src)[i] / 255.0f;
+typedef struct format format;
 
-            else if ((b == 8) && (s == SAMPLEFORMAT_INT))
-                for (uint32 i = 0; i < w * c; i++)
-                    dst[i] = ((int8 *)src)[i] / 127.0f;
+static void format_read(TIFF *T, format *F) {
+    memset(F, 0, sizeof(format));
 
-            else if ((b == 16) && (s == SAMPLEFORMAT_UINT || s == 0))
-                for (uint32 i = 0; i < w * c; i++)
-                    dst[i] = ((uint16 *)src)[i] / 65535.0f;
+    TIFFGetField(T, TIFFTAG_IMAGEWIDTH, &F->w);
+    TIFFGetField(T, TIFFTAG_IMAGELENGTH, &F->h);
+    TIFFGetFieldDefaulted(T, TIFFTAG_SAMPLESPERPIXEL, &F->c);
+    TIFFGetFieldDefaulted(T, TIFFTAG_BITSPERSAMPLE, &F->b);
+    TIFFGetField(T, TIFFTAG_SAMPLEFORMAT, &F->s);
+    TIFFGetFieldDefaulted(T, TIFFTAG_PLANARCONFIG, &F->p);
+    TIFFGetFieldDefaulted(T, TIFFTAG_ROWSPERSTRIP, &F->rps);
 
-            else if ((b == 16) && (s == SAMPLEFORMAT_INT))
-                for (uint32 i = 0; i < w * c; i++)
-                    dst[i] = ((int16 *)src)[i] / 32767.0f;
+    if (F->rps > F->h) F->rps = F->h;
+    F->tiled = TIFFIsTiled(T);
+}
 
-            else if ((b == 32) && (s == SAMPLEFORMAT_IEEEFP))
-                for (uint32 i = 0; i < w * c; i++) dst[i] = ((float *)src)[i];
+/* Allocate a buffer holding one strip, or one scanline for large strips.    */
+
+static void *format_buffer(TIFF *T, const format *F) {
+    if (F->rps <= STRIP_ROWS_MAX) return malloc(TIFFStripSize(T));
+    return malloc(TIFFScanlineSize(T));
+}
+
+/* Convert n samples between the format of the TIFF and float. Each case is  */
+/* a plain loop so that the compiler can vectorize it.                        */
+
+static int format_to_float(const format *F, const void *src, float *dst,
+                           size_t n) {
+    const uint16 b = F->b;
+    const uint16 s = F->s;
+
+    if ((b == 8) && (s == SAMPLEFORMAT_UINT || s == 0)) {
+        const uint8 *p = (const uint8 *)src;
+        for (size_t i = 0; i < n; i++) dst[i] = p[i] / 255.0f;
+
+    } else if ((b == 8) && (s == SAMPLEFORMAT_INT)) {
+        const int8 *p = (const int8 *)src;
+        for (size_t i = 0; i < n; i++) dst[i] = p[i] / 127.0f;
+
+    } else if ((b == 16) && (s == SAMPLEFORMAT_UINT || s == 0)) {
+        const uint16 *p = (const uint16 *)src;
+        for (size_t i = 0; i < n; i++) dst[i] = p[i] / 65535.0f;
+
+    } else if ((b == 16) && (s == SAMPLEFORMAT_INT)) {
+        const int16 *p = (const int16 *)src;
+        for (size_t i = 0; i < n; i++) dst[i] = p[i] / 32767.0f;
+
+    } else if ((b == 16) && (s == SAMPLEFORMAT_IEEEFP)) {
+        const uint16 *p = (const uint16 *)src;
+        for (size_t i = 0; i < n; i++) dst[i] = halfToFloat(p[i]);
+
+    } else if ((b == 32) && (s == SAMPLEFORMAT_IEEEFP))
+        memcpy(dst, src, n * sizeof(float));
+
+    else
+        return -1;
 
-            else
-                return -1;
-        }
-    }
     return +1;
 }
 
-/* Write one scanline to the given TIFF file, converting it from float to the */
-/* format of the TIFF. The file must have contiguous planar configuration.    */
-/* This is a drop-in replacement for TIFFWriteScanline.                       */
+static int float_to_format(const format *F, const float *src, void *dst,
+                           size_t n) {
+    const uint16 b = F->b;
+    const uint16 s = F->s;
 
-int TIFFWriteFloatScanline(TIFF *T, float *src, uint32 r) {
-    static tdata_t *dst = NULL;
-    static tsize_t len = 0;
+    if ((b == 8) && (s == SAMPLEFORMAT_UINT || s == 0)) {
+        uint8 *p = (uint8 *)dst;
+        for (size_t i = 0; i < n; i++)
+            p[i] = clamp(src[i], 0.0f, 1.0f) * 255.0f;
 
-    uint32 w = 0;
-    uint16 c = 0;
-    uint16 b = 0;
-    uint16 s = 0;
-    uint16 p = 0;
+    } else if ((b == 8) && (s == SAMPLEFORMAT_INT)) {
+        int8 *p = (int8 *)dst;
+        for (size_t i = 0; i < n; i++)
+            p[i] = clamp(src[i], 0.0f, 1.0f) * 127.0f;
 
-    TIFFGetField(T, TIFFTAG_IMAGEWIDTH, &w);
-    TIFFGetField(T, TIFFTAG_SAMPLESPERPIXEL, &c);
-    TIFFGetField(T, TIFFTAG_BITSPERSAMPLE, &b);
-    TIFFGetField(T, TIFFTAG_SAMPLEFORMAT, &s);
-    TIFFGetField(T, TIFFTAG_PLANARCONFIG, &p);
+    } else if ((b == 16) && (s == SAMPLEFORMAT_UINT || s == 0)) {
+        uint16 *p = (uint16 *)dst;
+        for (size_t i = 0; i < n; i++)
+            p[i] = clamp(src[i], 0.0f, 1.0f) * 65535.0f;
 
-    if (p == PLANARCONFIG_CONTIG) {
-        if (len != TIFFScanlineSize(T)) {
-            len = TIFFScanlineSize(T);
-            dst = (void **)realloc(dst, len);
-        }
+    } else if ((b == 16) && (s == SAMPLEFORMAT_INT)) {
+        int16 *p = (int16 *)dst;
+        for (size_t i = 0; i < n; i++)
+            p[i] = clamp(src[i], 0.0f, 1.0f) * 32767.0f;
 
-        if (dst) {
-            if ((b == 8) && (s == SAMPLEFORMAT_UINT || s == 0))
-                for (uint32 i = 0; i < w * c; i++)
-                    ((uint8 *)dst)[i] = clamp(src[i], 0.0f, 1.0f) * 255.0f;
+    } else if ((b == 16) && (s == SAMPLEFORMAT_IEEEFP)) {
+        uint16 *p = (uint16 *)dst;
+        for (size_t i = 0; i < n; i++)
+            p[i] = floatToHalf(clamp(src[i], -HALF_MAX, HALF_MAX));
 
-            else if ((b == 8) && (s == SAMPLEFORMAT_INT))
-                for (uint32 i = 0; i < w * c; i++)
-                    ((int8 *)dst)[i] = clamp(src[i], 0.0f, 1.0f) * 127.0f;
+    } else if ((b == 32) && (s == SAMPLEFORMAT_IEEEFP))
+        memcpy(dst, src, n * sizeof(float));
 
-            else if ((b == 16) && (s == SAMPLEFORMAT_UINT || s == 0))
-                for (uint32 i = 0; i < w * c; i++)
-                    ((uint16 *)dst)[i] = clamp(src[i], 0.0f, 1.0f) * 65535.0f;
+    else
+        return -1;
 
-            else if ((b == 16) && (s == SAMPLEFORMAT_INT))
-                for (uint32 i = 0; i < w * c; i++)
-                    ((int16 *)dst)[i] = clamp(src[i], 0.0f, 1.0f) * 32767.0f;
+    return +1;
+}
 
-            else if ((b == 32) && (s == SAMPLEFORMAT_IEEEFP))
-                for (uint32 i = 0; i < w * c; i++) ((float *)dst)[i] = src[i];
+/* Read rows r0 to r1 of the current directory as float, decoding whole      */
+/* strips. The file must have contiguous planar configuration. buf comes     */
+/* from format_buffer so that concurrent readers don't share any state.      */
 
-            else
-                return -1;
+static int format_read_rows(TIFF *T, const format *F, float *dst, uint32 r0,
+                            uint32 r1, void *buf) {
+    const size_t n = (size_t)F->w * F->c;
+    const tsize_t line = TIFFScanlineSize(T);
+    uint32 r = r0;
+
+    if (F->p != PLANARCONFIG_CONTIG || F->tiled) return -1;
 
-            if (TIFFWriteScanline(T, dst, r, 0) == -1) return -1;
+    if (F->rps <= STRIP_ROWS_MAX) {
+        while (r < r1) {
+            const tstrip_t k = TIFFComputeStrip(T, r, 0);
+            const uint32 s0 = k * F->rps;
+            const uint32 s1 = s0 + F->rps < r1 ? s0 + F->rps : r1;
+
+            if (TIFFReadEncodedStrip(T, k, buf, -1) < 0 ||
+                format_to_float(F, (char *)buf + (r - s0) * line,
+                                dst + n * (r - r0), n * (s1 - r)) < 0)
+                return -1;
+            r = s1;
         }
+    } else {
+        for (; r < r1; r++)
+            if (TIFFReadScanline(T, buf, r, 0) < 0 ||
+                format_to_float(F, buf, dst + n * (r - r0), n) < 0)
+                return -1;
+    }
+    return +1;
+}
+
+/* Write rows r0 to r1 of the current directory from float. r0 must start a  */
+/* strip of STRIP_ROWS rows, see image_writer_page.                           */
+
+static int format_write_rows(TIFF *T, const format *F, const float *src,
+                             uint32 r0, uint32 r1, void *buf) {
+    const size_t n = (size_t)F->w * F->c;
+    const tsize_t line = TIFFScanlineSize(T);
+
+    for (uint32 r = r0; r < r1; r += F->rps) {
+        const uint32 m = r + F->rps < r1 ? F->rps : r1 - r;
+
+        if (float_to_format(F, src + n * (r - r0), buf, n * m) < 0 ||
+            TIFFWriteEncodedStrip(T, r / F->rps, buf, line * m) < 0)
+            return -1;
     }
     return +1;
 }
@@ -240,7 +319,7 @@ int TIFFWriteFloatScanline(TIFF *T, float *src, uint32 r) {
 /* Allocate and initialize n image structures, each with a floating point     */
 /* pixel buffer with width w, height h, and channel count c.                  */
 
-static image *image_alloc(int n, int h, int w, int c, int b, int s) {
+static image *image_header(int n, int h, int w, int c, int b, int s) {
     image *img;
     int f;
 
@@ -253,7 +332,6 @@ static image *image_alloc(int n, int h, int w, int c, int b, int s) {
 
     if ((img = (image *)calloc(n, sizeof(image))))
         for (f = 0; f < n; f++) {
-            img[f].p = (float *)calloc(w * h * c, sizeof(float));
             img[f].w = w;
             img[f].h = h;
             img[f].c = c;
@@ -264,87 +342,276 @@ static image *image_alloc(int n, int h, int w, int c, int b, int s) {
     return img;
 }
 
+static image *image_alloc(int n, int h, int w, int c, int b, int s) {
+    image *img;
+    int f;
+
+    if ((img = image_header(n, h, w, c, b, s)))
+        for (f = 0; f < n; f++)
+            img[f].p = (float *)calloc((size_t)w * h * c, sizeof(float));
+
+    return img;
+}
+
 /* Release the storage for n image buffers.                                   */
-#if 0
-static void image_free(image *img, int n)
-{
+
+static void image_free(image *img, int n) {
     int f;
 
-    for (f = 0; f < n; f++)
-        free(img[f].p);
+    for (f = 0; f < n; f++) free(img[f].p);
 
     free(img);
 }
-#endif
 
-/* Read and return n pages from the named TIFF image file.                    */
+/* Return the largest of m and of the finite samples of the n given ones.  */
+
+static float sample_max(const float *p, size_t n, float m) {
+    for (size_t i = 0; i < n; i++)
+        if (p[i] > m && p[i] <= FLT_MAX) m = p[i];
+    return m;
+}
+
+/* Replace the values that would poison the filters: NaN and negative      */
+/* values by 0 and positive infinity by m, the largest finite value of the  */
+/* whole source, as HDR sources often contain a few of them.                */
+
+static void sanitize(float *p, size_t n, float m) {
+    for (size_t i = 0; i < n; i++)
+        if (!(p[i] >= 0.0f))
+            p[i] = 0.0f;
+        else if (p[i] > m)
+            p[i] = m;
+}
+
+/* Clean the n pages of an image read in memory. */
+
+static void image_sanitize(image *img, int n) {
+    float m = 0.0f;
+    int f;
+
+    for (f = 0; f < n; f++)
+        m = sample_max(img[f].p, (size_t)img[f].w * img[f].h * img[f].c, m);
+
+    for (f = 0; f < n; f++)
+        sanitize(img[f].p, (size_t)img[f].w * img[f].h * img[f].c, m);
+}
+
+/* Files are read and written with libtiff when they are named as TIFF and  */
+/* with OpenImageIO otherwise, so that HDR and EXR need no conversion.      */
+
+static int is_tiff(const char *name) {
+    const char *e = strrchr(name, '.');
+    return e && (!strcasecmp(e, ".tif") || !strcasecmp(e, ".tiff"));
+}
+
+/* Sample depth and format of an OpenImageIO type, and back. */
+
+static void oiio_format(TypeDesc t, int *b, int *s) {
+    if (t.basetype == TypeDesc::UINT8) {
+        *b = 8;
+        *s = SAMPLEFORMAT_UINT;
+    } else if (t.basetype == TypeDesc::UINT16) {
+        *b = 16;
+        *s = SAMPLEFORMAT_UINT;
+    } else if (t.basetype == TypeDesc::HALF) {
+        *b = 16;
+        *s = SAMPLEFORMAT_IEEEFP;
+    } else {
+        *b = 32;
+        *s = SAMPLEFORMAT_IEEEFP;
+    }
+}
+
+static TypeDesc oiio_type(int b, int s) {
+    if (b == 8) return TypeDesc::UINT8;
+    if (b == 16 && s == SAMPLEFORMAT_IEEEFP) return TypeDesc::HALF;
+    if (b == 16) return TypeDesc::UINT16;
+    return TypeDesc::FLOAT;
+}
+
+/* Read and return n subimages from the named image file. */
+
+static image *oiio_reader(const char *name, int n) {
+    ImageInput *in = 0;
+    image *img = 0;
+    int f;
+
+    if ((in = ImageInput::open(name))) {
+        if ((img = (image *)calloc(n, sizeof(image)))) {
+            for (f = 0; f < n; f++) {
+                ImageSpec spec;
+
+                if (!in->seek_subimage(f, 0, spec)) break;
+
+                const size_t size =
+                    (size_t)spec.width * spec.height * spec.nchannels;
+
+                if (!(img[f].p = (float *)malloc(size * sizeof(float))) ||
+                    !in->read_image(TypeDesc::FLOAT, img[f].p))
+                    break;
+
+                img[f].w = spec.width;
+                img[f].h = spec.height;
+                img[f].c = spec.nchannels;
+                oiio_format(spec.format, &img[f].b, &img[f].s);
+            }
+
+            if (f < n) {
+                fprintf(stderr, "can't read %d subimages of %s\n", n, name);
+                image_free(img, n);
+                img = 0;
+            }
+        }
+        in->close();
+        delete in;
+    } else
+        fprintf(stderr, "can't open %s\n", name);
+
+    return img;
+}
+
+/* Write n subimages to the named image file. Half float is converted here */
+/* to clamp it to HALF_MAX, floatToHalf overflows to infinity.              */
+
+static void oiio_writer(const char *name, const image *out, int n) {
+    ImageOutput *o = 0;
+    int f;
+
+    if (!(o = ImageOutput::create(name))) {
+        fprintf(stderr, "can't write %s\n", name);
+        return;
+    }
+    if (n > 1 && !o->supports("multiimage")) {
+        fprintf(stderr, "%s can't store %d subimages\n", name, n);
+        delete o;
+        return;
+    }
+
+    ImageOutput::OpenMode mode = ImageOutput::Create;
+
+    for (f = 0; f < n; f++) {
+        const TypeDesc type = oiio_type(out[f].b, out[f].s);
+        const size_t size = (size_t)out[f].w * out[f].h * out[f].c;
+        ImageSpec spec(out[f].w, out[f].h, out[f].c, type);
+
+        bool ok = o->open(name, spec, mode);
+
+        if (ok && type.basetype == TypeDesc::HALF) {
+            uint16 *p = (uint16 *)malloc(size * sizeof(uint16));
+            format F;
+
+            F.b = 16;
+            F.s = SAMPLEFORMAT_IEEEFP;
+
+            ok = p && float_to_format(&F, out[f].p, p, size) > 0 &&
+                 o->write_image(TypeDesc::HALF, p);
+            free(p);
+        } else if (ok)
+            ok = o->write_image(TypeDesc::FLOAT, out[f].p);
+
+        if (!ok) break;
+
+        mode = ImageOutput::AppendSubimage;
+    }
+    if (f != n) fprintf(stderr, "can't write %s\n", name);
+
+    o->close();
+    delete o;
+}
+
+/* Read and return n pages from the named TIFF image file. Each page is       */
+/* decoded by its own thread with its own TIFF handle.                        */
 
 static image *image_reader(const char *name, int n) {
     image *in = 0;
-    TIFF *T = 0;
+    int e = 0;
     int f;
 
-    if ((T = TIFFOpen(name, "r"))) {
-        if ((in = (image *)calloc(n, sizeof(image)))) {
-            for (f = 0; f < n; f++) {
-                uint16 b, c, s = 0;
-                uint32 w, h, r;
-                float *p;
-
-                TIFFSetDirectory(T, f);
-
-                TIFFGetField(T, TIFFTAG_IMAGEWIDTH, &w);
-                TIFFGetField(T, TIFFTAG_IMAGELENGTH, &h);
-                TIFFGetField(T, TIFFTAG_SAMPLESPERPIXEL, &c);
-                TIFFGetField(T, TIFFTAG_BITSPERSAMPLE, &b);
-                TIFFGetField(T, TIFFTAG_SAMPLEFORMAT, &s);
-
-                if ((p = (float *)malloc(h * w * c * sizeof(float)))) {
-                    for (r = 0; r < h; ++r)
-                        TIFFReadFloatScanline(T, p + w * c * r, r);
-
-                    in[f].p = (float *)p;
-                    in[f].w = (int)w;
-                    in[f].h = (int)h;
-                    in[f].c = (int)c;
-                    in[f].b = (int)b;
-                    in[f].s = (int)s;
+    if (!is_tiff(name)) return oiio_reader(name, n);
+
+    if ((in = (image *)calloc(n, sizeof(image)))) {
+#pragma omp parallel for reduction(+ : e)
+        for (f = 0; f < n; f++) {
+            TIFF *T = 0;
+            format F;
+
+            if ((T = TIFFOpen(name, "r")) && TIFFSetDirectory(T, f)) {
+                format_read(T, &F);
+
+                float *p = (float *)malloc((size_t)F.h * F.w * F.c *
+                                           sizeof(float));
+                void *buf = format_buffer(T, &F);
+
+                if (p && buf && format_read_rows(T, &F, p, 0, F.h, buf) > 0) {
+                    in[f].p = p;
+                    in[f].w = (int)F.w;
+                    in[f].h = (int)F.h;
+                    in[f].c = (int)F.c;
+                    in[f].b = (int)F.b;
+                    in[f].s = (int)F.s;
+                } else {
+                    free(p);
+                    e++;
                 }
-            }
+                free(buf);
+            } else
+                e++;
+
+            if (T) TIFFClose(T);
+        }
+
+        if (e) {
+            fprintf(stderr, "can't read %d pages of %s\n", n, name);
+            for (f = 0; f < n; f++) free(in[f].p);
+            free(in);
+            in = 0;
         }
-        TIFFClose(T);
     }
     return in;
 }
 
 /* Write n pages to the named TIFF image file.                                */
 
+static void image_writer_page(TIFF *T, const image *out, format *F) {
+    TIFFSetField(T, TIFFTAG_IMAGEWIDTH, out->w);
+    TIFFSetField(T, TIFFTAG_IMAGELENGTH, out->h);
+    TIFFSetField(T, TIFFTAG_SAMPLESPERPIXEL, out->c);
+    TIFFSetField(T, TIFFTAG_BITSPERSAMPLE, out->b);
+    TIFFSetField(T, TIFFTAG_SAMPLEFORMAT, out->s);
+    TIFFSetField(T, TIFFTAG_ORIENTATION, ORIENTATION_TOPLEFT);
+    // TIFFSetField(T, TIFFTAG_ORIENTATION,     ORIENTATION_BOTLEFT);
+    TIFFSetField(T, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+    TIFFSetField(T, TIFFTAG_ROWSPERSTRIP, STRIP_ROWS);
+
+    if (out->c == 1) {
+        TIFFSetField(T, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
+        TIFFSetField(T, TIFFTAG_ICCPROFILE, sizeof(grayicc), grayicc);
+    } else {
+        TIFFSetField(T, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
+        TIFFSetField(T, TIFFTAG_ICCPROFILE, sizeof(sRGBicc), sRGBicc);
+    }
+
+    format_read(T, F);
+}
+
 static void image_writer(const char *name, image *out, int n) {
     TIFF *T = 0;
-    uint32 f, r;
+    int f;
+
+    if (!is_tiff(name)) {
+        oiio_writer(name, out, n);
+        return;
+    }
 
     if ((T = TIFFOpen(name, "w"))) {
         for (f = 0; f < n; ++f) {
-            TIFFSetField(T, TIFFTAG_IMAGEWIDTH, out[f].w);
-            TIFFSetField(T, TIFFTAG_IMAGELENGTH, out[f].h);
-            TIFFSetField(T, TIFFTAG_SAMPLESPERPIXEL, out[f].c);
-            TIFFSetField(T, TIFFTAG_BITSPERSAMPLE, out[f].b);
-            TIFFSetField(T, TIFFTAG_SAMPLEFORMAT, out[f].s);
-            TIFFSetField(T, TIFFTAG_ORIENTATION, ORIENTATION_TOPLEFT);
-            // TIFFSetField(T, TIFFTAG_ORIENTATION,     ORIENTATION_BOTLEFT);
-            TIFFSetField(T, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
-
-            if (out[f].c == 1) {
-                TIFFSetField(T, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
-                TIFFSetField(T, TIFFTAG_ICCPROFILE, sizeof(grayicc), grayicc);
-            } else {
-                TIFFSetField(T, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
-                TIFFSetField(T, TIFFTAG_ICCPROFILE, sizeof(sRGBicc), sRGBicc);
-            }
+            format F;
+            image_writer_page(T, out + f, &F);
 
-            for (r = 0; r < out[f].h; ++r)
-                TIFFWriteFloatScanline(T, out[f].p + out[f].w * out[f].c * r,
-                                       r);
+            void *buf = malloc(TIFFStripSize(T));
+            if (!buf || format_write_rows(T, &F, out[f].p, 0, F.h, buf) < 0)
+                fprintf(stderr, "can't write page %d of %s\n", f, name);
+            free(buf);
 
             TIFFWriteDirectory(T);
         }
@@ -352,6 +619,239 @@ static void image_writer(const char *name, image *out, int n) {
     }
 }
 
+/*----------------------------------------------------------------------------*/
+/* Streaming source. The rows of a single page TIFF are read on demand by     */
+/* blocks kept in a small LRU cache per thread, so that the memory used by    */
+/* the source is bounded whatever its size.                                   */
+
+#define STREAM_ROWS 16
+
+struct block {
+    int r;     // first row of the block, -1 when empty
+    long u;    // last use
+    float *p;  // stream rows
+};
+
+typedef struct block block;
+
+struct cache {
+    int n;     // block count
+    long u;    // use counter
+    block *b;
+};
+
+typedef struct cache cache;
+
+struct stream {
+    TIFF *T;
+    format F;
+    void *buf;       // strip buffer, used under the stream_read lock
+    ImageInput *in;  // instead of T for the other formats
+    int h;
+    int w;
+    int c;
+    int rows;  // rows per block
+    int n;     // cache count, one per thread
+    cache *caches;
+    int error;  // a block could not be read
+    int clean;  // blocks are sanitized with max
+    float max;  // largest finite sample of the source
+};
+
+typedef struct stream stream;
+
+static inline int thread_num() {
+#ifdef _OPENMP
+    return omp_get_thread_num();
+#else
+    return 0;
+#endif
+}
+
+static inline int thread_max() {
+#ifdef _OPENMP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+/* Open the first page of the named TIFF for streaming, using at most budget  */
+/* bytes of cache overall.                                                    */
+
+static image *stream_reader(const char *name, size_t budget) {
+    image *in = 0;
+    stream *t = 0;
+    int rows = STREAM_ROWS;
+
+    if (!(in = (image *)calloc(1, sizeof(image))) ||
+        !(t = (stream *)calloc(1, sizeof(stream)))) {
+        free(in);
+        return 0;
+    }
+
+    if (is_tiff(name)) {
+        if ((t->T = TIFFOpen(name, "r"))) {
+            const format *F = &t->F;
+            format_read(t->T, &t->F);
+
+            /* Blocks match the strips of the file when they are of a sane  */
+            /* size, so that each miss decodes exactly one strip.           */
+
+            if (F->rps >= STREAM_ROWS && F->rps <= STRIP_ROWS_MAX)
+                rows = (int)F->rps;
+
+            t->buf = format_buffer(t->T, F);
+
+            in->w = (int)F->w;
+            in->h = (int)F->h;
+            in->c = (int)F->c;
+            in->b = (int)F->b;
+            in->s = (int)F->s;
+        }
+    } else if ((t->in = ImageInput::open(name))) {
+        const ImageSpec &spec = t->in->spec();
+
+        /* Tiled files are read by rows of tiles, only the tiles under the  */
+        /* rows needed are decoded.                                         */
+
+        if (spec.tile_height >= STREAM_ROWS &&
+            spec.tile_height <= (int)STRIP_ROWS_MAX)
+            rows = spec.tile_height;
+
+        in->w = spec.width;
+        in->h = spec.height;
+        in->c = spec.nchannels;
+        oiio_format(spec.format, &in->b, &in->s);
+    }
+
+    if (!t->T && !t->in) {
+        fprintf(stderr, "can't open %s\n", name);
+        free(t);
+        free(in);
+        return 0;
+    }
+
+    /* Two blocks per thread at least, the linear filter reads two rows at  */
+    /* once. When they don't fit in the budget the blocks get fewer rows,   */
+    /* then fewer threads remap.                                            */
+
+    const size_t line = (size_t)in->w * in->c * sizeof(float);
+    int threads = thread_max();
+
+    while (rows > 1 && 2 * threads * line * rows > budget)
+        rows = (rows + 1) / 2;
+    while (threads > 1 && 2 * threads * line * rows > budget) threads--;
+
+    if (2 * threads * line * rows > budget)
+        fprintf(stderr, "two rows of %s take %zu MB, over the budget\n", name,
+                (2 * line) >> 20);
+#ifdef _OPENMP
+    omp_set_num_threads(threads);
+#endif
+
+    const size_t size = line * rows;
+
+    t->h = in->h;
+    t->w = in->w;
+    t->c = in->c;
+    t->rows = rows;
+    t->n = threads;
+    t->caches = (cache *)calloc(t->n, sizeof(cache));
+
+    int n = (int)(budget / size / t->n);
+    if (n < 2) n = 2;
+
+    for (int k = 0; k < t->n; k++) {
+        t->caches[k].n = n;
+        t->caches[k].b = (block *)calloc(n, sizeof(block));
+        for (int l = 0; l < n; l++) {
+            t->caches[k].b[l].r = -1;
+            t->caches[k].b[l].p = (float *)malloc(size);
+        }
+    }
+
+    in->t = t;
+
+    fprintf(stderr, "streaming %s with %d blocks of %d rows on %d threads\n",
+            name, n, rows, t->n);
+    return in;
+}
+
+/* Return row i of a streamed image, reading its block if it is not cached.   */
+
+static const float *stream_row(stream *t, int i) {
+    cache *C = t->caches + thread_num();
+    const int r = i - i % t->rows;
+    block *lru = C->b;
+
+    C->u++;
+
+    for (int k = 0; k < C->n; k++) {
+        block *B = C->b + k;
+        if (B->r == r) {
+            B->u = C->u;
+            return B->p + (size_t)t->w * t->c * (i - r);
+        }
+        if (B->u < lru->u) lru = B;
+    }
+
+    /* Miss. Replace the least recently used block. */
+
+    const int e = r + t->rows < t->h ? r + t->rows : t->h;
+    int ok;
+
+#pragma omp critical(stream_read)
+    ok = t->in ? t->in->read_scanlines(r, e, 0, TypeDesc::FLOAT, lru->p)
+               : format_read_rows(t->T, &t->F, lru->p, r, e, t->buf) > 0;
+
+    /* A block that failed stays invalid, the caller gets black rows and    */
+    /* the error is reported once the remap is done.                        */
+
+    if (ok) {
+        if (t->clean) sanitize(lru->p, (size_t)t->w * t->c * (e - r), t->max);
+        lru->r = r;
+    } else {
+        fprintf(stderr, "can't read rows %d to %d\n", r, e);
+        memset(lru->p, 0, (size_t)t->w * t->c * (e - r) * sizeof(float));
+        lru->r = -1;
+        t->error = 1;
+    }
+
+    lru->u = C->u;
+    return lru->p + (size_t)t->w * t->c * (i - r);
+}
+
+/* Find the largest finite sample of a streamed image with a first pass over */
+/* its rows, then sanitize the blocks as they are read. The blocks read by   */
+/* the pass are dropped as they are not sanitized.                           */
+
+static void stream_sanitize(stream *t) {
+    float m = 0.0f;
+
+    for (int r = 0; r < t->h; r += t->rows) {
+        const int e = r + t->rows < t->h ? r + t->rows : t->h;
+        m = sample_max(stream_row(t, r), (size_t)t->w * t->c * (e - r), m);
+    }
+
+    for (int k = 0; k < t->n; k++)
+        for (int l = 0; l < t->caches[k].n; l++) t->caches[k].b[l].r = -1;
+
+    t->max = m;
+    t->clean = 1;
+}
+
+/* Return whether a block of a streamed image could not be read. */
+
+static int stream_failed(const image *img) {
+    return img->t && img->t->error;
+}
+
+static inline const float *image_row(const image *img, long i) {
+    if (img->t) return stream_row(img->t, (int)i);
+    return img->p + (size_t)img->w * img->c * i;
+}
+
 /*----------------------------------------------------------------------------*/
 
 #define SAMP(img, i, j, k) img.p[img.c * (img.w * i + j) + k]
@@ -468,14 +968,14 @@ static void filter_linear(const image *img, float i, float j, float *p) {
     const float di = ii - i0;
     const float dj = jj - j0;
 
+    const float *r0 = image_row(img, i0);
+    const float *r1 = image_row(img, i1);
+
     int k;
 
     for (k = 0; k < img->c; k++)
-        p[k] += lerp(lerp(img->p[(img->w * i0 + j0) * img->c + k],
-                          img->p[(img->w * i0 + j1) * img->c + k], dj),
-                     lerp(img->p[(img->w * i1 + j0) * img->c + k],
-                          img->p[(img->w * i1 + j1) * img->c + k], dj),
-                     di);
+        p[k] += lerp(lerp(r0[j0 * img->c + k], r0[j1 * img->c + k], dj),
+                     lerp(r1[j0 * img->c + k], r1[j1 * img->c + k], dj), di);
 }
 
 /* Sample an image at row i column j using nearest neighbor.                  */
@@ -487,10 +987,11 @@ static void filter_nearest(const image *img, float i, float j, float *p) {
     const long i0 = lrintf(ii);
     const long j0 = lrintf(jj);
 
+    const float *r0 = image_row(img, i0);
+
     int k;
 
-    for (k = 0; k < img->c; k++)
-        p[k] += img->p[(img->w * i0 + j0) * img->c + k];
+    for (k = 0; k < img->c; k++) p[k] += r0[j0 * img->c + k];
 }
 
 /*----------------------------------------------------------------------------*/
@@ -591,7 +1092,7 @@ static int rect_to_img(int *f, float *i, float *j, int h, int w,
 /*----------------------------------------------------------------------------*/
 
 static int cube_to_env(int f, float i, float j, int h, int w, float *v) {
-    const int p[6][3][3] = {
+    static const int p[6][3][3] = {
         {{0, 0, -1}, {0, -1, 0}, {1, 0, 0}},
         {{0, 0, 1}, {0, -1, 0}, {-1, 0, 0}},
         {{1, 0, 0}, {0, 0, 1}, {0, 1, 0}},
@@ -675,6 +1176,52 @@ static int rect_to_env(int f, float i, float j, int h, int w, float *v) {
 
 /*----------------------------------------------------------------------------*/
 
+static const point cent_points[] = {
+    {0.5f, 0.5f},
+};
+
+static const point rgss_points[] = {
+    {0.125f, 0.625f},
+    {0.375f, 0.125f},
+    {0.625f, 0.875f},
+    {0.875f, 0.375f},
+};
+
+static const point box2_points[] = {
+    {0.25f, 0.25f},
+    {0.25f, 0.75f},
+    {0.75f, 0.25f},
+    {0.75f, 0.75f},
+};
+
+static const point box3_points[] = {
+    {0.1666667f, 0.1666667f}, {0.1666667f, 0.5000000f},
+    {0.1666667f, 0.8333333f}, {0.5000000f, 0.1666667f},
+    {0.5000000f, 0.5000000f}, {0.5000000f, 0.8333333f},
+    {0.8333333f, 0.1666667f}, {0.8333333f, 0.5000000f},
+    {0.8333333f, 0.8333333f},
+};
+
+static const point box4_points[] = {
+    {0.125f, 0.125f}, {0.125f, 0.375f}, {0.125f, 0.625f}, {0.125f, 0.875f},
+    {0.375f, 0.125f}, {0.375f, 0.375f}, {0.375f, 0.625f}, {0.375f, 0.875f},
+    {0.625f, 0.125f}, {0.625f, 0.375f}, {0.625f, 0.625f}, {0.625f, 0.875f},
+    {0.875f, 0.125f}, {0.875f, 0.375f}, {0.875f, 0.625f}, {0.875f, 0.875f},
+};
+
+static const pattern cent_pattern = {1, cent_points};
+static const pattern rgss_pattern = {4, rgss_points};
+static const pattern box2_pattern = {4, box2_points};
+static const pattern box3_pattern = {9, box3_points};
+static const pattern box4_pattern = {16, box4_points};
+
+/* The adaptive pattern has no points, it selects one of the above for each */
+/* block of output pixels, see tile_adaptive.                                */
+
+static const pattern adaptive_pattern = {0, 0};
+
+/*----------------------------------------------------------------------------*/
+
 static int xfm(const float *rot, float *v) {
     if (rot[0]) {
         float s = sinf(rot[0] * PI / 180.0f);
@@ -706,30 +1253,57 @@ static int xfm(const float *rot, float *v) {
     return 1;
 }
 
-void supersample(const image *src, const image *dst, const pattern *pat,
-                 const float *rot, filter fil, to_img img, to_env env, int f,
-                 int i, int j) {
-    int F;
-    float I;
-    float J;
-    int k;
-    int c = 0;
-    float *p = dst[f].p + dst[f].c * (dst[f].w * i + j);
+/* Fold the x, y, z rotations of xfm into a row major 3x3 matrix.             */
+
+static void xfm_matrix(const float *rot, float *m) {
+    for (int k = 0; k < 3; k++) {
+        float v[3] = {0.f, 0.f, 0.f};
+        v[k] = 1.f;
+        xfm(rot, v);
+        m[k] = v[0];
+        m[3 + k] = v[1];
+        m[6 + k] = v[2];
+    }
+}
+
+static inline int mxfm(const float *m, float *v) {
+    const float x = m[0] * v[0] + m[1] * v[1] + m[2] * v[2];
+    const float y = m[3] * v[0] + m[4] * v[1] + m[5] * v[2];
+    const float z = m[6] * v[0] + m[7] * v[1] + m[8] * v[2];
+
+    v[0] = x;
+    v[1] = y;
+    v[2] = z;
+    return 1;
+}
+
+/* The projections, the filter and the pattern are template arguments so     */
+/* that the compiler can inline and unroll the whole pipeline of each pixel.  */
+
+template <to_img IMG, to_env ENV, filter FIL, const pattern *PAT>
+static inline void supersample(const image *src, const image *dst,
+                               const float *mat, int f, int r, int i, int j) {
+    int F;
+    float I;
+    float J;
+    int k;
+    int c = 0;
+    float *p = dst[f].p + dst[f].c * ((size_t)dst[f].w * (i - r) + j);
 
     /* For each sample of the supersampling pattern... */
 
-    for (k = 0; k < pat->n; k++) {
-        const float ii = pat->p[k].i + i;
-        const float jj = pat->p[k].j + j;
+    for (k = 0; k < PAT->n; k++) {
+        const float ii = PAT->p[k].i + i;
+        const float jj = PAT->p[k].j + j;
 
         /* Project and unproject giving the source location. Sample there. */
 
         float v[3];
 
-        if (env(f, ii, jj, dst->h, dst->w, v) && xfm(rot, v) &&
-            img(&F, &I, &J, src->h, src->w, v)) {
+        if (ENV(f, ii, jj, dst->h, dst->w, v) && mxfm(mat, v) &&
+            IMG(&F, &I, &J, src->h, src->w, v)) {
 #if 1
-            fil(src + F, I, J, p);
+            FIL(src + F, I, J, p);
 #else
             p[0] = (v[0] + 1.0f) / 2.0f;
             p[1] = (v[1] + 1.0f) / 2.0f;
@@ -744,73 +1318,850 @@ void supersample(const image *src, const image *dst, const pattern *pat,
     for (k = 0; k < dst->c; k++) p[k] /= c;
 }
 
-void process(const image *src, const image *dst, const pattern *pat,
-             const float *rot, filter fil, to_img img, to_env env, int n) {
-    int i;
-    int j;
-    int f;
+/* Sample rows i0 to i1 and columns j0 to j1 of destination page f, whose   */
+/* data starts at row r.                                                     */
+
+template <to_img IMG, to_env ENV, filter FIL, const pattern *PAT>
+static void tile(const image *src, const image *dst, const float *mat, int f,
+                 int r, int i0, int i1, int j0, int j1) {
+    for (int i = i0; i < i1; i++)
+        for (int j = j0; j < j1; j++)
+            supersample<IMG, ENV, FIL, PAT>(src, dst, mat, f, r, i, j);
+}
+
+/* Estimate the size in source pixels of the footprint of output pixel      */
+/* (i, j) of page f, from the distances between the source locations of its  */
+/* center and the centers of its neighbors. Return a negative value where    */
+/* the mapping is not smooth: off the projection or across cube faces.       */
+
+template <to_img IMG, to_env ENV>
+static float footprint(const image *src, const image *dst, const float *mat,
+                       int f, int i, int j) {
+    const float di[3] = {0.5f, 1.5f, 0.5f};
+    const float dj[3] = {0.5f, 0.5f, 1.5f};
+
+    int F[3];
+    float I[3];
+    float J[3];
+
+    for (int k = 0; k < 3; k++) {
+        float v[3];
+
+        if (!(ENV(f, i + di[k], j + dj[k], dst->h, dst->w, v) &&
+              mxfm(mat, v) && IMG(F + k, I + k, J + k, src->h, src->w, v)))
+            return -1.0f;
+    }
+    if (F[1] != F[0] || F[2] != F[0]) return -1.0f;
+
+    /* Rows and columns of the step along i and along j, the columns wrap   */
+    /* around the panoramas.                                                */
+
+    float a = I[1] - I[0];
+    float b = fabsf(J[1] - J[0]);
+    float c = I[2] - I[0];
+    float d = fabsf(J[2] - J[0]);
+
+    if (b > src->w / 2) b = src->w - b;
+    if (d > src->w / 2) d = src->w - d;
+
+    const float si = sqrtf(a * a + b * b);
+    const float sj = sqrtf(c * c + d * d);
+
+    return si > sj ? si : sj;
+}
+
+/* Sample a tile by blocks of ADAPTIVE x ADAPTIVE pixels, with the cheapest  */
+/* pattern that covers the footprint of the center of each block: one        */
+/* sample where the source is magnified, up to 4 x 4 where it is minified by  */
+/* 3 or more. The footprint costs three projections per block.               */
+
+#define ADAPTIVE 4
+
+static inline const pattern *adaptive_select(float d) {
+    if (d < 0.0f || d > 3.0f) return &box4_pattern;
+    if (d > 2.0f) return &box3_pattern;
+    if (d > 1.0f) return &rgss_pattern;
+    return &cent_pattern;
+}
+
+template <to_img IMG, to_env ENV, filter FIL>
+static void tile_adaptive(const image *src, const image *dst,
+                          const float *mat, int f, int r, int i0, int i1,
+                          int j0, int j1) {
+    for (int bi = i0; bi < i1; bi += ADAPTIVE)
+        for (int bj = j0; bj < j1; bj += ADAPTIVE) {
+            const int ie = bi + ADAPTIVE < i1 ? bi + ADAPTIVE : i1;
+            const int je = bj + ADAPTIVE < j1 ? bj + ADAPTIVE : j1;
+            const pattern *q = adaptive_select(footprint<IMG, ENV>(
+                src, dst, mat, f, (bi + ie - 1) / 2, (bj + je - 1) / 2));
+
+            if (q == &box4_pattern)
+                tile<IMG, ENV, FIL, &box4_pattern>(src, dst, mat, f, r, bi,
+                                                   ie, bj, je);
+            else if (q == &box3_pattern)
+                tile<IMG, ENV, FIL, &box3_pattern>(src, dst, mat, f, r, bi,
+                                                   ie, bj, je);
+            else if (q == &rgss_pattern)
+                tile<IMG, ENV, FIL, &rgss_pattern>(src, dst, mat, f, r, bi,
+                                                   ie, bj, je);
+            else
+                tile<IMG, ENV, FIL, &cent_pattern>(src, dst, mat, f, r, bi,
+                                                   ie, bj, je);
+        }
+}
+
+typedef void (*tiler)(const image *, const image *, const float *, int, int,
+                      int, int, int, int);
+
+/* Destination pages are processed in square tiles so that each thread     */
+/* writes a contiguous block of one page while reading a coherent region of  */
+/* the source. Tiles are numbered page major over pages from f0 and rows r0  */
+/* to r1, the data of the destination pages starts at row r0.                */
+
+#define TILE 64
+
+static inline int tile_count(const image *dst, int r0, int r1) {
+    return ((r1 - r0 + TILE - 1) / TILE) * ((dst->w + TILE - 1) / TILE);
+}
+
+static inline void process_tile(tiler tile, const image *src,
+                                const image *dst, const float *mat, int f0,
+                                int r0, int r1, int t) {
+    const int tw = (dst->w + TILE - 1) / TILE;
+    const int tn = tile_count(dst, r0, r1);
+
+    const int f = f0 + t / tn;
+    const int i0 = r0 + ((t % tn) / tw) * TILE;
+    const int j0 = ((t % tn) % tw) * TILE;
+    const int i1 = i0 + TILE < r1 ? i0 + TILE : r1;
+    const int j1 = j0 + TILE < dst->w ? j0 + TILE : dst->w;
+
+    tile(src, dst, mat, f, r0, i0, i1, j0, j1);
+}
+
+/* Sample pages f0 to f1 and rows r0 to r1 of the destination. */
+
+static void process(tiler tile, const image *src, const image *dst,
+                    const float *mat, int f0, int f1, int r0, int r1) {
+    const int tn = tile_count(dst, r0, r1);
+    int t;
+
+#pragma omp parallel for schedule(dynamic)
+    for (t = 0; t < (f1 - f0) * tn; t++)
+        process_tile(tile, src, dst, mat, f0, r0, r1, t);
+}
+
+/* Remap to the named TIFF file by bands of rows, so that only one band of    */
+/* the destination is in memory. The band size follows the memory budget.    */
+
+static int stream_writer(const char *name, const image *src, image *dst,
+                         int n, tiler tile, const float *mat, size_t budget) {
+    TIFF *T = 0;
+    int e = 0;
+
+    if ((T = TIFFOpen(name, "w"))) {
+        for (int f = 0; f < n; ++f) {
+            const size_t line = (size_t)dst[f].w * dst[f].c * sizeof(float);
+            int rows = (int)(budget / line);
+
+            /* Bands start on a strip boundary of the output, a band is one  */
+            /* strip at least.                                               */
+
+            rows -= rows % STRIP_ROWS;
+            if (rows < STRIP_ROWS) {
+                rows = STRIP_ROWS;
+                fprintf(stderr, "a strip of %s takes %zu MB, over the budget\n",
+                        name, (line * rows) >> 20);
+            }
+            if (rows > dst[f].h) rows = dst[f].h;
 
-    /* Sample all destination rows, columns, and pages. */
+            format F;
 
-#pragma omp parallel for private(j, f)
-    for (i = 0; i < dst->h; i++)
-        for (j = 0; j < dst->w; j++)
-            for (f = 0; f < n; f++)
-                supersample(src, dst, pat, rot, fil, img, env, f, i, j);
+            dst[f].p = (float *)malloc(line * rows);
+
+            image_writer_page(T, dst + f, &F);
+
+            void *buf = malloc(TIFFStripSize(T));
+
+            for (int r0 = 0; r0 < dst[f].h && !e; r0 += rows) {
+                const int r1 = r0 + rows < dst[f].h ? r0 + rows : dst[f].h;
+
+                memset(dst[f].p, 0, line * rows);
+                process(tile, src, dst, mat, f, f + 1, r0, r1);
+
+                if ((e = stream_failed(src))) break;
+
+                if (format_write_rows(T, &F, dst[f].p, r0, r1, buf) < 0)
+                    fprintf(stderr, "can't write rows %d to %d of %s\n", r0,
+                            r1, name);
+            }
+
+            if (!e) TIFFWriteDirectory(T);
+            free(buf);
+            free(dst[f].p);
+            dst[f].p = 0;
+            if (e) break;
+        }
+        TIFFClose(T);
+
+        /* Don't leave an output made of missing source rows. */
+
+        if (e) remove(name);
+    } else
+        e = 1;
+
+    return e ? -1 : 0;
 }
 
 /*----------------------------------------------------------------------------*/
+/* Cube map mip chain.                                                        */
 
-static point cent_points[] = {
-    {0.5f, 0.5f},
-};
+/* Solid angle of texel (i, j) of an n x n cube face, from the area of its   */
+/* projection on the unit sphere.                                            */
 
-static point rgss_points[] = {
-    {0.125f, 0.625f},
-    {0.375f, 0.125f},
-    {0.625f, 0.875f},
-    {0.875f, 0.375f},
+static inline double cube_area(double x, double y) {
+    return atan2(x * y, sqrt(x * x + y * y + 1.0));
+}
+
+static float cube_texel_solid_angle(int i, int j, int n) {
+    const double x0 = 2.0 * j / n - 1.0;
+    const double x1 = 2.0 * (j + 1) / n - 1.0;
+    const double y0 = 2.0 * i / n - 1.0;
+    const double y1 = 2.0 * (i + 1) / n - 1.0;
+
+    return (float)(cube_area(x0, y0) - cube_area(x0, y1) - cube_area(x1, y0) +
+                   cube_area(x1, y1));
+}
+
+/* Halve the six pages of a cube map. Each texel is the mean of its 2 x 2    */
+/* children weighted by their solid angle. The children of a texel always    */
+/* lie on its own face, so no border is needed at the seams.                 */
+
+static image *cube_downsample(const image *src) {
+    const int n = (src->w + 1) / 2;
+    const int c = src->c;
+    image *dst;
+    int k;
+
+    if ((dst = image_alloc(6, n, n, c, src->b, src->s))) {
+#pragma omp parallel for schedule(dynamic)
+        for (k = 0; k < 6 * n; k++) {
+            const int f = k / n;
+            const int i = k % n;
+
+            for (int j = 0; j < n; j++) {
+                float *p = dst[f].p + ((size_t)n * i + j) * c;
+                float W = 0.0f;
+
+                for (int ii = 2 * i; ii < 2 * i + 2 && ii < src->h; ii++)
+                    for (int jj = 2 * j; jj < 2 * j + 2 && jj < src->w; jj++) {
+                        const float *q =
+                            src[f].p + ((size_t)src->w * ii + jj) * c;
+                        const float w = cube_texel_solid_angle(ii, jj, src->w);
+
+                        for (int l = 0; l < c; l++) p[l] += w * q[l];
+                        W += w;
+                    }
+
+                for (int l = 0; l < c; l++) p[l] /= W;
+            }
+        }
+    }
+    return dst;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Remap tables. The source location of every sample of a destination only   */
+/* depends on the projections, the sizes, the pattern and the rotation, so   */
+/* batches of conversions with the same parameters can record them once in a */
+/* cache file and then only gather and blend the source.                     */
+/*                                                                            */
+/* layout, native endianness:                                                 */
+/*   remap_header                                                             */
+/*   uint64_t rows[num * h + 1]   first sample of each row of all pages      */
+/*   uint8_t  counts[num * h * w] valid samples of each pixel, 4 aligned     */
+/*   sample   samples[rows[num * h]]                                          */
+
+#define REMAP_VERSION 1
+#define REMAP_MAX_MB 512  // larger tables are not built, see remap_build
+
+struct sample {
+    int f;    // source page
+    float i;  // source row
+    float j;  // source column
 };
 
-static point box2_points[] = {
-    {0.25f, 0.25f},
-    {0.25f, 0.75f},
-    {0.75f, 0.25f},
-    {0.75f, 0.75f},
+typedef struct sample sample;
+
+struct remap_header {
+    char magic[4];  // "EVRM"
+    uint32_t version;
+    int num;
+    int h;
+    int w;
+    int reserved;
+    char key[256];  // parameters, checked against hash collisions
 };
 
-static point box3_points[] = {
-    {0.1666667f, 0.1666667f}, {0.1666667f, 0.5000000f},
-    {0.1666667f, 0.8333333f}, {0.5000000f, 0.1666667f},
-    {0.5000000f, 0.5000000f}, {0.5000000f, 0.8333333f},
-    {0.8333333f, 0.1666667f}, {0.8333333f, 0.5000000f},
-    {0.8333333f, 0.8333333f},
+typedef struct remap_header remap_header;
+
+struct remap {
+    void *data;
+    size_t size;
+    int mapped;  // data is a file mapping, otherwise allocated
+    const uint64_t *rows;
+    const uint8_t *counts;
+    const sample *samples;
 };
 
-static point box4_points[] = {
-    {0.125f, 0.125f}, {0.125f, 0.375f}, {0.125f, 0.625f}, {0.125f, 0.875f},
-    {0.375f, 0.125f}, {0.375f, 0.375f}, {0.375f, 0.625f}, {0.375f, 0.875f},
-    {0.625f, 0.125f}, {0.625f, 0.375f}, {0.625f, 0.625f}, {0.625f, 0.875f},
-    {0.875f, 0.125f}, {0.875f, 0.375f}, {0.875f, 0.625f}, {0.875f, 0.875f},
+typedef struct remap remap;
+
+static size_t remap_counts_offset(int num, int h) {
+    return sizeof(remap_header) + ((size_t)num * h + 1) * sizeof(uint64_t);
+}
+
+static size_t remap_samples_offset(int num, int h, int w) {
+    return (remap_counts_offset(num, h) + (size_t)num * h * w + 3) & ~3ul;
+}
+
+static void remap_pointers(remap *R) {
+    const remap_header *H = (const remap_header *)R->data;
+    const char *p = (const char *)R->data;
+
+    R->rows = (const uint64_t *)(p + sizeof(remap_header));
+    R->counts = (const uint8_t *)(p + remap_counts_offset(H->num, H->h));
+    R->samples =
+        (const sample *)(p + remap_samples_offset(H->num, H->h, H->w));
+}
+
+/* Record the valid source samples of pixel (i, j) of destination page f to */
+/* s, or only count them when s is null. This repeats supersample and the   */
+/* block selection of tile_adaptive so that the gather gives the same      */
+/* result as the direct remap.                                              */
+
+template <to_img IMG, to_env ENV>
+static int record(const image *src, const image *dst, const float *mat,
+                  const pattern *pat, int f, int i, int j, sample *s) {
+    int c = 0;
+
+    if (pat == &adaptive_pattern) {
+        const int bi = i - i % ADAPTIVE;
+        const int bj = j - j % ADAPTIVE;
+        const int ie = bi + ADAPTIVE < dst->h ? bi + ADAPTIVE : dst->h;
+        const int je = bj + ADAPTIVE < dst->w ? bj + ADAPTIVE : dst->w;
+
+        pat = adaptive_select(footprint<IMG, ENV>(
+            src, dst, mat, f, (bi + ie - 1) / 2, (bj + je - 1) / 2));
+    }
+
+    for (int k = 0; k < pat->n; k++) {
+        const float ii = pat->p[k].i + i;
+        const float jj = pat->p[k].j + j;
+
+        float v[3];
+        int F;
+        float I;
+        float J;
+
+        if (ENV(f, ii, jj, dst->h, dst->w, v) && mxfm(mat, v) &&
+            IMG(&F, &I, &J, src->h, src->w, v)) {
+            if (s) {
+                s[c].f = F;
+                s[c].i = I;
+                s[c].j = J;
+            }
+            c++;
+        }
+    }
+    return c;
+}
+
+/* Build the table of the pages of dst in memory, counting the samples of   */
+/* each row first then recording them. Tables over REMAP_MAX_MB are not     */
+/* built and the destination is remapped directly.                          */
+
+template <to_img IMG, to_env ENV>
+static remap *remap_build(const image *src, const image *dst, int num,
+                          const float *mat, const pattern *pat,
+                          const char *key) {
+    const int h = dst->h;
+    const int w = dst->w;
+    const size_t rn = (size_t)num * h;
+
+    uint64_t *rows = (uint64_t *)calloc(rn + 1, sizeof(uint64_t));
+    uint8_t *counts = (uint8_t *)malloc(rn * w);
+    remap *R = 0;
+    long k;
+
+    if (!rows || !counts) {
+        free(rows);
+        free(counts);
+        return 0;
+    }
+
+#pragma omp parallel for schedule(dynamic)
+    for (k = 0; k < (long)rn; k++) {
+        uint64_t n = 0;
+
+        for (int j = 0; j < w; j++) {
+            const int c = record<IMG, ENV>(src, dst, mat, pat, (int)(k / h),
+                                           (int)(k % h), j, 0);
+            counts[k * w + j] = (uint8_t)c;
+            n += c;
+        }
+        rows[k + 1] = n;
+    }
+
+    for (size_t l = 0; l < rn; l++) rows[l + 1] += rows[l];
+
+    const size_t size =
+        remap_samples_offset(num, h, w) + rows[rn] * sizeof(sample);
+
+    /* The whole table is built in memory before it is written, a large     */
+    /* pattern on a large destination would take gigabytes.                 */
+
+    if (size > (size_t)REMAP_MAX_MB * 1024 * 1024) {
+        fprintf(stderr,
+                "remap table of %zu MB over %d MB, remapping directly\n",
+                size >> 20, REMAP_MAX_MB);
+        free(rows);
+        free(counts);
+        return 0;
+    }
+
+    if ((R = (remap *)calloc(1, sizeof(remap))) &&
+        (R->data = calloc(1, size))) {
+        remap_header *H = (remap_header *)R->data;
+
+        memcpy(H->magic, "EVRM", 4);
+        H->version = REMAP_VERSION;
+        H->num = num;
+        H->h = h;
+        H->w = w;
+        snprintf(H->key, sizeof(H->key), "%s", key);
+
+        R->size = size;
+        remap_pointers(R);
+
+        memcpy((void *)R->rows, rows, (rn + 1) * sizeof(uint64_t));
+        memcpy((void *)R->counts, counts, rn * w);
+
+        sample *samples = (sample *)R->samples;
+
+#pragma omp parallel for schedule(dynamic)
+        for (k = 0; k < (long)rn; k++) {
+            sample *s = samples + rows[k];
+
+            for (int j = 0; j < w; j++)
+                s += record<IMG, ENV>(src, dst, mat, pat, (int)(k / h),
+                                      (int)(k % h), j, s);
+        }
+    } else {
+        free(R);
+        R = 0;
+    }
+
+    free(rows);
+    free(counts);
+    return R;
+}
+
+/* Map a cached table, checking that it matches the parameters. */
+
+static remap *remap_load(const char *name, const char *key, int num, int h,
+                         int w) {
+    struct stat st;
+    remap *R = 0;
+    void *data;
+    int fd;
+
+    if ((fd = open(name, O_RDONLY)) < 0) return 0;
+
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(remap_header) &&
+        (data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) !=
+            MAP_FAILED) {
+        const remap_header *H = (const remap_header *)data;
+
+        if (!memcmp(H->magic, "EVRM", 4) && H->version == REMAP_VERSION &&
+            H->num == num && H->h == h && H->w == w &&
+            !strncmp(H->key, key, sizeof(H->key)) &&
+            (size_t)st.st_size >= remap_samples_offset(num, h, w) &&
+            (R = (remap *)calloc(1, sizeof(remap)))) {
+            R->data = data;
+            R->size = st.st_size;
+            R->mapped = 1;
+            remap_pointers(R);
+
+            if (remap_samples_offset(num, h, w) +
+                    R->rows[(size_t)num * h] * sizeof(sample) !=
+                R->size) {
+                free(R);
+                R = 0;
+            }
+        }
+        if (!R) munmap(data, st.st_size);
+    }
+    close(fd);
+    return R;
+}
+
+/* Write a table to the cache under a temporary name then rename it, so that */
+/* concurrent conversions never map a partial file.                          */
+
+static void remap_write(const char *name, const remap *R) {
+    char tmp[1024];
+    FILE *fp;
+
+    snprintf(tmp, sizeof(tmp), "%s.%d", name, (int)getpid());
+
+    if ((fp = fopen(tmp, "wb"))) {
+        const int ok = fwrite(R->data, 1, R->size, fp) == R->size;
+
+        if (fclose(fp) == 0 && ok && rename(tmp, name) == 0) return;
+        remove(tmp);
+    }
+    fprintf(stderr, "can't write %s\n", name);
+}
+
+/* Gather the samples of a tile from its table. */
+
+template <filter FIL>
+static void tile_gather(const image *src, const image *dst, const float *mat,
+                        int f, int r, int i0, int i1, int j0, int j1) {
+    const remap *R = dst->r;
+
+    for (int i = i0; i < i1; i++) {
+        const size_t row = (size_t)f * dst->h + i;
+        const uint8_t *n = R->counts + row * dst->w;
+        const sample *s = R->samples + R->rows[row];
+
+        for (int j = 0; j < j0; j++) s += n[j];
+
+        for (int j = j0; j < j1; j++) {
+            float *p = dst[f].p + dst[f].c * ((size_t)dst[f].w * (i - r) + j);
+            const int c = n[j];
+
+            for (int k = 0; k < c; k++, s++) FIL(src + s->f, s->i, s->j, p);
+
+            /* Normalize the sample. */
+
+            for (int k = 0; k < dst->c; k++) p[k] /= c;
+        }
+    }
+}
+
+typedef remap *(*remap_builder)(const image *, const image *, int,
+                                const float *, const pattern *, const char *);
+
+template <to_img IMG>
+static remap_builder select_remap_builder(to_env env) {
+    if (env == cube_to_env) return remap_build<IMG, cube_to_env>;
+    if (env == dome_to_env) return remap_build<IMG, dome_to_env>;
+    if (env == hemi_to_env) return remap_build<IMG, hemi_to_env>;
+    if (env == ball_to_env) return remap_build<IMG, ball_to_env>;
+    if (env == rect_to_env) return remap_build<IMG, rect_to_env>;
+    return 0;
+}
+
+static remap_builder select_remap_builder(to_img img, to_env env) {
+    if (img == cube_to_img) return select_remap_builder<cube_to_img>(env);
+    if (img == dome_to_img) return select_remap_builder<dome_to_img>(env);
+    if (img == hemi_to_img) return select_remap_builder<hemi_to_img>(env);
+    if (img == ball_to_img) return select_remap_builder<ball_to_img>(env);
+    if (img == rect_to_img) return select_remap_builder<rect_to_img>(env);
+    return 0;
+}
+
+static tiler select_gather(filter fil) {
+    if (fil == filter_linear) return tile_gather<filter_linear>;
+    if (fil == filter_nearest) return tile_gather<filter_nearest>;
+    return 0;
+}
+
+/* Return the table of a destination from the cache directory, building and */
+/* caching it on a miss. The key names all the parameters of the mapping.   */
+
+static remap *remap_cached(const char *dir, const char *i, const char *o,
+                           const char *p, const image *src, const image *dst,
+                           int num, to_img img, to_env env, const float *mat,
+                           const pattern *pat) {
+    char key[256];
+    char name[1024];
+    uint64_t hash = 14695981039346656037ull;  // FNV-1a
+    remap *R;
+    int k;
+
+    k = snprintf(key, sizeof(key), "%s %dx%d %s %dx%dx%d %s", i, src->w,
+                 src->h, o, dst->w, dst->h, num, p);
+    for (int l = 0; l < 9 && k < (int)sizeof(key); l++)
+        k += snprintf(key + k, sizeof(key) - k, " %a", mat[l]);
+
+    for (const char *c = key; *c; c++)
+        hash = (hash ^ (uint8_t)*c) * 1099511628211ull;
+
+    snprintf(name, sizeof(name), "%s/envremap_%016llx.map", dir,
+             (unsigned long long)hash);
+
+    if ((R = remap_load(name, key, num, dst->h, dst->w))) return R;
+
+    remap_builder build = select_remap_builder(img, env);
+
+    if (build && (R = build(src, dst, num, mat, pat, key)))
+        remap_write(name, R);
+
+    return R;
+}
+
+/* Select the process specialization, one level per template argument.       */
+
+template <to_img IMG, to_env ENV, filter FIL>
+static tiler select_tiler(const pattern *pat) {
+    if (pat == &cent_pattern) return tile<IMG, ENV, FIL, &cent_pattern>;
+    if (pat == &rgss_pattern) return tile<IMG, ENV, FIL, &rgss_pattern>;
+    if (pat == &box2_pattern) return tile<IMG, ENV, FIL, &box2_pattern>;
+    if (pat == &box3_pattern) return tile<IMG, ENV, FIL, &box3_pattern>;
+    if (pat == &box4_pattern) return tile<IMG, ENV, FIL, &box4_pattern>;
+    if (pat == &adaptive_pattern) return tile_adaptive<IMG, ENV, FIL>;
+    return 0;
+}
+
+template <to_img IMG, to_env ENV>
+static tiler select_tiler(filter fil, const pattern *pat) {
+    if (fil == filter_linear)
+        return select_tiler<IMG, ENV, filter_linear>(pat);
+    if (fil == filter_nearest)
+        return select_tiler<IMG, ENV, filter_nearest>(pat);
+    return 0;
+}
+
+template <to_img IMG>
+static tiler select_tiler(to_env env, filter fil, const pattern *pat) {
+    if (env == cube_to_env)
+        return select_tiler<IMG, cube_to_env>(fil, pat);
+    if (env == dome_to_env)
+        return select_tiler<IMG, dome_to_env>(fil, pat);
+    if (env == hemi_to_env)
+        return select_tiler<IMG, hemi_to_env>(fil, pat);
+    if (env == ball_to_env)
+        return select_tiler<IMG, ball_to_env>(fil, pat);
+    if (env == rect_to_env)
+        return select_tiler<IMG, rect_to_env>(fil, pat);
+    return 0;
+}
+
+static tiler select_tiler(to_img img, to_env env, filter fil,
+                          const pattern *pat) {
+    if (img == cube_to_img)
+        return select_tiler<cube_to_img>(env, fil, pat);
+    if (img == dome_to_img)
+        return select_tiler<dome_to_img>(env, fil, pat);
+    if (img == hemi_to_img)
+        return select_tiler<hemi_to_img>(env, fil, pat);
+    if (img == ball_to_img)
+        return select_tiler<ball_to_img>(env, fil, pat);
+    if (img == rect_to_img)
+        return select_tiler<rect_to_img>(env, fil, pat);
+    return 0;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Output targets. Several outputs of any projection and size can be made   */
+/* from a single decode of the source.                                       */
+
+#define MAX_TARGETS 32
+#define MAX_LEVELS 32
+
+struct target {
+    const char *type;  // projection
+    int n;             // size
+    const char *path;
+    int mips;    // write the mip chain to a %d path
+    int copy;    // the source itself, no remap
+    int num;     // page count
+    to_env env;
+    image *dst;  // pages
+    int nl;      // level count, 1 but for mip chains
+    image *levels[MAX_LEVELS];
+    tiler tile;
 };
 
-static const pattern cent_pattern = {1, cent_points};
-static const pattern rgss_pattern = {4, rgss_points};
-static const pattern box2_pattern = {4, box2_points};
-static const pattern box3_pattern = {9, box3_points};
-static const pattern box4_pattern = {16, box4_points};
+typedef struct target target;
+
+/* Parse a type:size:path target specification in place. */
+
+static int target_parse(target *t, char *arg) {
+    char *size = strchr(arg, ':');
+    char *path = size ? strchr(size + 1, ':') : 0;
+
+    if (size && path) {
+        *size++ = 0;
+        *path++ = 0;
+
+        t->type = arg;
+        t->n = strtol(size, 0, 0);
+        t->path = path;
+
+        return (t->n >= 0 && *path) ? +1 : -1;
+    }
+    return -1;
+}
+
+/* Select the projection and the kernel of a target and prepare its pages. */
+/* Streaming allocates bands when writing, it only writes TIFF files       */
+/* without mips. A size of 0 is the size sn of the source of type i, and a   */
+/* target of that type is then a copy of the source when it is in memory   */
+/* and not rotated.                                                         */
+
+static int target_init(target *t, const char *i, const image *src, int sn,
+                       to_img img, filter fil, const pattern *pat, size_t m,
+                       int rotated) {
+    if (t->n == 0) t->n = sn;
+
+    int h = t->n;
+    int w = t->n;
+    to_env env;
+
+    t->num = 1;
+    t->mips = 0;
+    t->copy = 0;
+    t->nl = 0;
+
+    if (!strcmp(t->type, "cubemips")) {
+        t->num = 6;
+        t->mips = 1;
+        env = cube_to_env;
+    } else if (!strcmp(t->type, "cube")) {
+        t->num = 6;
+        env = cube_to_env;
+    } else if (!strcmp(t->type, "dome")) {
+        env = dome_to_env;
+    } else if (!strcmp(t->type, "hemi")) {
+        env = hemi_to_env;
+    } else if (!strcmp(t->type, "ball")) {
+        env = ball_to_env;
+    } else if (!strcmp(t->type, "rect")) {
+        w = 2 * t->n;
+        env = rect_to_env;
+    } else
+        return -1;
+
+    t->env = env;
+    t->tile = select_tiler(img, env, fil, pat);
+
+    /* The cube source has borders, don't copy it. */
+
+    if (!rotated && !strcmp(t->type, i) && img != cube_to_img && src->p &&
+        src->h == h && src->w == w) {
+        const size_t size = (size_t)w * h * src->c * sizeof(float);
+
+        if (!(t->dst = image_header(1, h, w, src->c, src->b, src->s)) ||
+            !(t->dst->p = (float *)malloc(size)))
+            return -1;
+
+        memcpy(t->dst->p, src->p, size);
+        t->copy = 1;
+    } else if (m && (t->mips || !is_tiff(t->path))) {
+        fprintf(stderr, "%s can't be streamed, -m writes TIFF without mips\n",
+                t->path);
+        return -1;
+    } else if (m)
+        t->dst = image_header(t->num, h, w, src->c, src->b, src->s);
+    else
+        t->dst = image_alloc(t->num, h, w, src->c, src->b, src->s);
+
+    return t->dst ? +1 : -1;
+}
+
+/* Downsample the level 0 of a mip chain target down to 1 x 1. */
+
+static void target_mips(target *t) {
+    t->levels[0] = t->dst;
+    t->nl = 1;
+
+    if (t->mips)
+        while (t->levels[t->nl - 1]->w > 1 && t->nl < MAX_LEVELS &&
+               (t->levels[t->nl] = cube_downsample(t->levels[t->nl - 1])))
+            t->nl++;
+}
+
+/* Write all files of the in memory targets concurrently. */
+
+static void targets_writer(target *targets, int nt) {
+    int first[MAX_TARGETS + 1];
+    int k;
+
+    first[0] = 0;
+    for (k = 0; k < nt; k++) first[k + 1] = first[k] + targets[k].nl;
+
+#pragma omp parallel for schedule(dynamic)
+    for (k = 0; k < first[nt]; k++) {
+        int l = 0;
+        while (k >= first[l + 1]) l++;
+
+        const target *T = targets + l;
+        char name[1024];
+
+        if (T->mips)
+            snprintf(name, sizeof(name), T->path, k - first[l]);
+        else
+            snprintf(name, sizeof(name), "%s", T->path);
+
+        image_writer(name, T->levels[k - first[l]], T->num);
+    }
+}
+
+/* Remap to all in memory targets in a single parallel loop over the tiles   */
+/* of all of their pages, so that small outputs don't leave threads idle.    */
+
+static void process_targets(const image *src, target *targets, int nt,
+                            const float *mat) {
+    long first[MAX_TARGETS + 1];
+    long t;
+    int k;
+
+    first[0] = 0;
+    for (k = 0; k < nt; k++) {
+        const image *dst = targets[k].dst;
+        if (!dst->p || targets[k].copy) {  // streamed or copied
+            first[k + 1] = first[k];
+            continue;
+        }
+        first[k + 1] = first[k] + (long)targets[k].num *
+                                      tile_count(dst, 0, dst->h);
+    }
+
+#pragma omp parallel for schedule(dynamic)
+    for (t = 0; t < first[nt]; t++) {
+        int l = 0;
+        while (t >= first[l + 1]) l++;
+
+        const target *T = targets + l;
+        process_tile(T->tile, src, T->dst, mat, 0, 0, T->dst->h,
+                     (int)(t - first[l]));
+    }
+}
 
 /*----------------------------------------------------------------------------*/
 
 static int usage(const char *exe) {
     fprintf(
         stderr,
-        "%s [-i input] [-o output] [-p pattern] [-f filter] [-n n] src dst\n"
+        "%s [-i input] [-o output] [-p pattern] [-f filter] [-n n] [-m mb] "
+        "[-h] [-c dir] [-s] src [dst]\n"
         "\t-i ... Input  file type: cube, dome, hemi, ball, rect  [rect]\n"
         "\t-o ... Output file type: cube, dome, hemi, ball, rect  [rect]\n"
+        "\t       or a type:size:path target, may be repeated\n"
+        "\t       cubemips:size:path_%%d.tif writes a cube mip chain\n"
+        "\t       size 0 keeps the source size\n"
         "\t-p ... Sample pattern: cent, rgss, box2, box3, box4    [rgss]\n"
+        "\t       or adaptive\n"
         "\t-f ... Filter type: nearest, linear                  [linear]\n"
-        "\t-n ... Output size                                     [1024]\n",
+        "\t-n ... Output size                                     [1024]\n"
+        "\t-m ... Memory budget in MB to stream the remap           [0]\n"
+        "\t-h ... Write half float outputs\n"
+        "\t-c ... Directory of cached remap tables\n"
+        "\t-s ... Replace NaN, negative and infinite source samples\n"
+        "Files not named .tif or .tiff are read and written with OpenImageIO\n",
         exe);
     return 0;
 }
@@ -818,6 +2169,7 @@ static int usage(const char *exe) {
 /* Todo: different format remap */
 // Eg: envremap [-i input] [-o output] [-p pattern] [-f filter] [-n n] src.tif
 // dst.tif
+// Eg: envremap -i rect -o cube:256:cube.tif -o rect:512:rect.tif src.tif
 int main(int argc, char **argv) {
     /* Set some default behaviors. */
 
@@ -831,14 +2183,42 @@ int main(int argc, char **argv) {
     int n = 1024;
     int c;
 
+    /* Output targets given as type:size:path. */
+
+    target targets[MAX_TARGETS];
+    int nt = 0;
+
+    /* Memory budget in bytes of the streaming mode, 0 reads all in memory. */
+
+    size_t m = 0;
+
+    /* Write the outputs as half float instead of the source format. */
+
+    int hf = 0;
+
+    /* Directory of the cached remap tables, none by default. */
+
+    const char *cache = 0;
+
+    /* Replace the NaN, negative and infinite samples of the source. */
+
+    int clean = 0;
+
     /* Parse the command line options. */
 
-    while ((c = getopt(argc, argv, "i:o:p:n:f:x:y:z:")) != -1) switch (c) {
+    while ((c = getopt(argc, argv, "i:o:p:n:f:x:y:z:m:hc:s")) != -1)
+        switch (c) {
             case 'i':
                 i = optarg;
                 break;
             case 'o':
-                o = optarg;
+                if (!strchr(optarg, ':'))
+                    o = optarg;
+                else if (nt < MAX_TARGETS &&
+                         target_parse(targets + nt, optarg) > 0)
+                    nt++;
+                else
+                    return usage(argv[0]);
                 break;
             case 'p':
                 p = optarg;
@@ -858,18 +2238,28 @@ int main(int argc, char **argv) {
             case 'n':
                 n = strtol(optarg, 0, 0);
                 break;
+            case 'm':
+                m = (size_t)strtol(optarg, 0, 0) * 1024 * 1024;
+                break;
+            case 'h':
+                hf = 1;
+                break;
+            case 'c':
+                cache = optarg;
+                break;
+            case 's':
+                clean = 1;
+                break;
 
             default:
                 return usage(argv[0]);
         }
 
-    int num = 1;
     image *src = 0;
-    image *dst = 0;
     image *tmp = 0;
     to_img img;
-    to_env env;
     filter fil;
+    const pattern *pat;
 
     /* Select the sampler. */
 
@@ -880,76 +2270,142 @@ int main(int argc, char **argv) {
     else
         return usage(argv[0]);
 
-    /* Read the input image. */
+    /* Select the pattern. */
+
+    if (!strcmp(p, "cent"))
+        pat = &cent_pattern;
+    else if (!strcmp(p, "rgss"))
+        pat = &rgss_pattern;
+    else if (!strcmp(p, "box2"))
+        pat = &box2_pattern;
+    else if (!strcmp(p, "box3"))
+        pat = &box3_pattern;
+    else if (!strcmp(p, "box4"))
+        pat = &box4_pattern;
+    else if (!strcmp(p, "adaptive"))
+        pat = &adaptive_pattern;
+    else
+        return usage(argv[0]);
+
+    /* The cube input needs its six pages in memory for the borders.        */
+
+    if (m && !strcmp(i, "cube")) {
+        fprintf(stderr, "streaming is not supported for cube input\n");
+        m = 0;
+    }
+
+    /* The dst argument is a target of the -o type and the -n size.         */
 
-    if (optind + 2 <= argc) {
+    if (optind + 2 <= argc && nt < MAX_TARGETS) {
+        targets[nt].type = o;
+        targets[nt].n = n;
+        targets[nt].path = argv[optind + 1];
+        nt++;
+    }
+
+    if (nt == 0) return usage(argv[0]);
+
+    /* Read the input image. Half of the budget goes to the source cache.    */
+
+    if (optind + 1 <= argc) {
         if (!strcmp(i, "cube")) {
             tmp = image_reader(argv[optind], 6);
+            if (clean && tmp) image_sanitize(tmp, 6);
             src = image_border(tmp);
             img = cube_to_img;
         } else if (!strcmp(i, "dome")) {
-            src = image_reader(argv[optind], 1);
+            src = m ? stream_reader(argv[optind], m / 2)
+                    : image_reader(argv[optind], 1);
             img = dome_to_img;
         } else if (!strcmp(i, "hemi")) {
-            src = image_reader(argv[optind], 1);
+            src = m ? stream_reader(argv[optind], m / 2)
+                    : image_reader(argv[optind], 1);
             img = hemi_to_img;
         } else if (!strcmp(i, "ball")) {
-            src = image_reader(argv[optind], 1);
+            src = m ? stream_reader(argv[optind], m / 2)
+                    : image_reader(argv[optind], 1);
             img = ball_to_img;
         } else if (!strcmp(i, "rect")) {
-            src = image_reader(argv[optind], 1);
+            src = m ? stream_reader(argv[optind], m / 2)
+                    : image_reader(argv[optind], 1);
             img = rect_to_img;
         } else
             return usage(argv[0]);
     } else
         return usage(argv[0]);
 
-    /* Prepare the output image. */
+    /* Clean the other sources, the cube is cleaned before its borders are  */
+    /* copied.                                                              */
 
-    if (src) {
-        if (!strcmp(o, "cube")) {
-            dst = image_alloc((num = 6), n, n, src->c, src->b, src->s);
-            env = cube_to_env;
-        } else if (!strcmp(o, "dome")) {
-            dst = image_alloc((num = 1), n, n, src->c, src->b, src->s);
-            env = dome_to_env;
-        } else if (!strcmp(o, "hemi")) {
-            dst = image_alloc((num = 1), n, n, src->c, src->b, src->s);
-            env = hemi_to_env;
-        } else if (!strcmp(o, "ball")) {
-            dst = image_alloc((num = 1), n, n, src->c, src->b, src->s);
-            env = ball_to_env;
-        } else if (!strcmp(o, "rect")) {
-            dst = image_alloc((num = 1), n, 2 * n, src->c, src->b, src->s);
-            env = rect_to_env;
-        } else
-            return usage(argv[0]);
+    if (clean && src && !tmp) {
+        if (src->t)
+            stream_sanitize(src->t);
+        else
+            image_sanitize(src, 1);
     }
 
-    /* Perform the remapping using the selected pattern. */
+    /* Prepare the output targets. */
 
-    if (src && dst) {
-        if (!strcmp(p, "cent"))
-            process(src, dst, &cent_pattern, rot, fil, img, env, num);
+    if (src) {
+        const int sn = tmp ? tmp->h : src->h;
+        const int rotated = rot[0] != 0.f || rot[1] != 0.f || rot[2] != 0.f;
+        float mat[9];
 
-        else if (!strcmp(p, "rgss"))
-            process(src, dst, &rgss_pattern, rot, fil, img, env, num);
+        xfm_matrix(rot, mat);
 
-        else if (!strcmp(p, "box2"))
-            process(src, dst, &box2_pattern, rot, fil, img, env, num);
+        for (int k = 0; k < nt; k++) {
+            target *t = targets + k;
 
-        else if (!strcmp(p, "box3"))
-            process(src, dst, &box3_pattern, rot, fil, img, env, num);
+            if (target_init(t, i, src, sn, img, fil, pat, m, rotated) < 0) {
+                usage(argv[0]);
+                return 1;
+            }
 
-        else if (!strcmp(p, "box4"))
-            process(src, dst, &box4_pattern, rot, fil, img, env, num);
+            if (hf)
+                for (int l = 0; l < t->num; l++) {
+                    t->dst[l].b = 16;
+                    t->dst[l].s = SAMPLEFORMAT_IEEEFP;
+                }
 
-        else
-            return usage(argv[0]);
+            /* Gather from a cached table of the source samples. */
 
-        /* Write the output. */
+            remap *R;
 
-        image_writer(argv[optind + 1], dst, num);
+            if (cache && !t->copy &&
+                (R = remap_cached(cache, i, t->type, p, src, t->dst, t->num,
+                                  img, t->env, mat, pat))) {
+                for (int l = 0; l < t->num; l++) t->dst[l].r = R;
+                t->tile = select_gather(fil);
+            }
+        }
+
+        /* Perform the remapping and write the outputs. Streamed targets   */
+        /* are made one after the other with the same source cache, mip     */
+        /* chains are always in memory.                                    */
+
+        int k;
+
+        process_targets(src, targets, nt, mat);
+
+        if (stream_failed(src)) {
+            fprintf(stderr, "can't read %s\n", argv[optind]);
+            return 1;
+        }
+
+        for (k = 0; k < nt; k++)
+            if (targets[k].dst->p) target_mips(targets + k);
+
+        targets_writer(targets, nt);
+
+        if (m)
+            for (k = 0; k < nt; k++)
+                if (!targets[k].dst->p &&
+                    stream_writer(targets[k].path, src, targets[k].dst,
+                                  targets[k].num, targets[k].tile, mat,
+                                  m / 2) < 0) {
+                    fprintf(stderr, "can't write %s\n", targets[k].path);
+                    return 1;
+                }
     }
 
     return 0;
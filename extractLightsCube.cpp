@@ -0,0 +1,295 @@
+/* -*-c++-*- */
+
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+
+#include <algorithm>
+#include <vector>
+#include "Cubemap"
+#include "Light"
+#include "Math"
+#include "SummedAreaTable"
+#include "SummedAreaTableRegion"
+
+// faces in an order where each face is a neighbour of the previous one:
+// top, the four sides around the vertical axis then bottom. The cut
+// groups faces that follow each other
+static const uint cubeFaceOrder[6] = {2, 0, 4, 1, 5, 3};
+
+// points sampled on each border of a region to find its panorama bounds
+#define CUBE_BORDER_SAMPLES 16
+
+/**
+ * solid angles of the texels of a face, the same for the six faces
+ */
+struct CubeFaceSolidAngles {
+    uint _size;
+    double* _solidAngles;
+
+    void operator()(const tbb::blocked_range<uint>& r) const {
+        for (uint y = r.begin(); y != r.end(); ++y) {
+            for (uint x = 0; x < _size; ++x) {
+                _solidAngles[size_t(y) * _size + x] =
+                    texelPixelSolidAngleCubeMap(float(x), float(y), _size);
+            }
+        }
+    }
+};
+
+/**
+ * Build the tables of the six faces of a cubemap
+ */
+void createCubeTables(Cubemap& cubemap, SummedAreaTable faces[6],
+                      const uint moments) {
+    Cubemap::MipLevel& images = cubemap.getImages();
+    const uint size = images.getSize();
+
+    std::vector<double> solidAngles(size_t(size) * size);
+    CubeFaceSolidAngles texels;
+    texels._size = size;
+    texels._solidAngles = &solidAngles[0];
+    tbb::parallel_for(tbb::blocked_range<uint>(0, size), texels);
+
+    for (uint face = 0; face < 6; ++face) {
+        faces[face].createLumCubeFace(images.imageFace(face), size,
+                                      images.getSamplePerPixel(),
+                                      &solidAngles[0], moments);
+    }
+}
+
+// solid angle of the faces, the faces tables are not normalized
+double cubeWeightAccumulation(const SummedAreaTable faces[6]) {
+    double weightAccum = 0.0;
+    for (uint face = 0; face < 6; ++face)
+        weightAccum += faces[face].getWeightAccumulation();
+    return weightAccum;
+}
+
+// luminance of the cubemap, normalized as a panorama one
+double cubeLuminanceSum(const SummedAreaTable faces[6]) {
+    double sum = 0.0;
+    for (uint face = 0; face < 6; ++face) sum += faces[face].getSum();
+    return sum * (4.0 * PI) / cubeWeightAccumulation(faces);
+}
+
+/**
+ * Cut the faces from begin to end in cubeFaceOrder in two groups of the
+ * nearest luminance until groups are a single face, then cut the face.
+ * A region can't span several faces so when there are no cuts left, each
+ * face of the group is a region
+ */
+void splitCubeFaces(const SatRegion faceRegions[6], const double faceSums[6],
+                    const uint begin, const uint end, const uint n,
+                    SatRegionVector& regions, bool variance) {
+    if (end - begin == 1) {
+        splitRecursive(faceRegions[begin], n, regions, variance);
+        return;
+    }
+
+    if (n == 0) {
+        regions.insert(regions.end(), faceRegions + begin, faceRegions + end);
+        return;
+    }
+
+    double total = 0.0;
+    for (uint i = begin; i < end; ++i) total += faceSums[i];
+
+    uint split = begin + 1;
+    double sum = faceSums[begin];
+    double best = fabs(2.0 * sum - total);
+    for (uint i = begin + 2; i < end; ++i) {
+        sum += faceSums[i - 1];
+        const double balance = fabs(2.0 * sum - total);
+        if (balance < best) {
+            best = balance;
+            split = i;
+        }
+    }
+
+    splitCubeFaces(faceRegions, faceSums, begin, split, n - 1, regions,
+                   variance);
+    splitCubeFaces(faceRegions, faceSums, split, end, n - 1, regions,
+                   variance);
+}
+
+/**
+ * The median cut algorithm Or Variance Minimisation on a cubemap, the first
+ * cuts split the faces in groups. The faces sums are read from the fixed
+ * point tables as the luminance tables of the faces have their own scale
+ *
+ * faces - Summed area tables of the faces
+ * n - number of subdivision, yields 2^n cuts
+ * regions - an empty vector that gets filled with generated regions
+ * variance - variance minimisation instead of median cut, the tables need
+ * the log
+ */
+void cubeMedianVarianceCut(const SummedAreaTable faces[6], const uint n,
+                           SatRegionVector& regions, bool variance) {
+    regions.clear();
+
+    SatRegion faceRegions[6];
+    double faceSums[6];
+    for (uint i = 0; i < 6; ++i) {
+        const SummedAreaTable& face = faces[cubeFaceOrder[i]];
+        faceRegions[i].create(0, 0, face.width(), face.height(), &face);
+
+        double sums[SummedAreaTable::EXACT_COUNT];
+        face.exactSums(0, 0, face.width(), face.height(), sums);
+        faceSums[i] = sums[SummedAreaTable::EXACT_LUM];
+    }
+
+    splitCubeFaces(faceRegions, faceSums, 0, 6, n, regions, variance);
+}
+
+/**
+ * Direction of a point of a face given in texels, as envremap
+ */
+Vec3d cubeFaceDirection(const uint face, const double x, const double y,
+                        const uint size) {
+    const double u = 2.0 * x / size - 1.0;
+    const double v = 2.0 * y / size - 1.0;
+
+    Vec3d d;
+    for (uint k = 0; k < 3; ++k) {
+        d[k] = CubemapFace[face][0][k] * u + CubemapFace[face][1][k] * v +
+               CubemapFace[face][2][k];
+    }
+    d.normalize();
+    return d;
+}
+
+/**
+ * Position of a direction in a panorama made by envremap, 0..1
+ */
+Vec2d panoramaPosition(const Vec3d& d) {
+    return Vec2d(0.5 + atan2(d[0], -d[2]) / (2.0 * PI),
+                 acos(std::max(-1.0, std::min(1.0, d[1]))) / PI);
+}
+
+/**
+ * Solid angle of a region of a face
+ */
+double cubeRegionSolidAngle(const SatRegion& r, const uint size) {
+    const double x0 = 2.0 * r._x / size - 1.0;
+    const double y0 = 2.0 * r._y / size - 1.0;
+    const double x1 = 2.0 * (r._x + r._w) / size - 1.0;
+    const double y1 = 2.0 * (r._y + r._h) / size - 1.0;
+    return AreaElement(x0, y0) - AreaElement(x0, y1) - AreaElement(x1, y0) +
+           AreaElement(x1, y1);
+}
+
+/**
+ * Bounds of a region of a face in the panorama, from points on its borders.
+ * The longitudes are taken around the centroid so the bounds stop at the
+ * panorama seam as the panorama regions, a region around a pole spans the
+ * whole width
+ */
+void cubeRegionBounds(const SatRegion& r, const uint face, const uint size,
+                      const Vec2d& centroid, Light& l) {
+    double minX = 0.0, maxX = 0.0;
+    double minY = centroid[1], maxY = centroid[1];
+
+    for (uint i = 0; i <= CUBE_BORDER_SAMPLES; ++i) {
+        const double t = (double)i / CUBE_BORDER_SAMPLES;
+        const double x = r._x + t * r._w;
+        const double y = r._y + t * r._h;
+        const Vec2d points[4] = {
+            panoramaPosition(cubeFaceDirection(face, x, r._y, size)),
+            panoramaPosition(cubeFaceDirection(face, x, r._y + r._h, size)),
+            panoramaPosition(cubeFaceDirection(face, r._x, y, size)),
+            panoramaPosition(cubeFaceDirection(face, r._x + r._w, y, size))};
+
+        for (uint p = 0; p < 4; ++p) {
+            double dx = points[p][0] - centroid[0];
+            dx -= floor(dx + 0.5);
+            minX = std::min(minX, dx);
+            maxX = std::max(maxX, dx);
+            minY = std::min(minY, points[p][1]);
+            maxY = std::max(maxY, points[p][1]);
+        }
+    }
+
+    // the pole is the center of the top and bottom faces
+    const double center = size * 0.5;
+    const bool pole = (face == 2 || face == 3) && r._x <= center &&
+                      center <= r._x + r._w && r._y <= center &&
+                      center <= r._y + r._h;
+
+    if (pole) {
+        l._x = 0.0;
+        l._w = 1.0;
+        if (face == 2)
+            minY = 0.0;
+        else
+            maxY = 1.0;
+    } else {
+        l._x = std::max(0.0, centroid[0] + minX);
+        l._w = std::min(1.0, centroid[0] + maxX) - l._x;
+    }
+
+    l._y = minY;
+    l._h = maxY - minY;
+}
+
+/**
+ * convert cubemap regions to Lights, in the panorama coordinates of the
+ * panorama regions. The area of a light is its part of the sphere solid
+ * angle
+ */
+void createLightsFromCubeRegions(const SatRegionVector& regions,
+                                 const SummedAreaTable faces[6],
+                                 LightVector& lights, const double maxLum,
+                                 Cubemap& cubemap) {
+    const Cubemap::MipLevel& images = cubemap.getImages();
+    const uint size = images.getSize();
+    const uint nc = images.getSamplePerPixel();
+    const double weigth = cubeWeightAccumulation(faces);
+
+    for (SatRegionVector::const_iterator region = regions.begin();
+         region != regions.end(); ++region) {
+        const uint face = region->_sat - faces;
+        Light l;
+
+        // init values
+        l._merged = false;
+        l._mergedNum = 0;
+
+        // set light at centroid
+        const Vec2d c = region->centroid();
+        l._centroidPosition =
+            panoramaPosition(cubeFaceDirection(face, c[0], c[1], size));
+        cubeRegionBounds(*region, face, size, l._centroidPosition, l);
+
+        l._areaSize = cubeRegionSolidAngle(*region, size) / (4.0 * PI);
+
+        const uint x = std::min(size - 1, uint(c[0]));
+        const uint y = std::min(size - 1, uint(c[1]));
+        const float* pixel = images.imageFace(face) + (y * size + x) * nc;
+        l._luminancePixel = luminance(pixel[0], pixel[1], pixel[2]) *
+                            texelPixelSolidAngleCubeMap(x, y, size);
+
+        // exact sums of the region pixels
+        double sums[SummedAreaTable::EXACT_COUNT];
+        faces[face].exactSums(region->_x, region->_y, region->_w, region->_h,
+                              sums);
+
+        // normalize
+        l._sum = sums[SummedAreaTable::EXACT_LUM] * (4.0 * PI) / weigth;
+
+        // per pixel as the panorama lights
+        const double pixels = region->areaSize();
+        l._variance = (l._sum * l._sum) / pixels;
+
+        // Colors
+        l._rAverage = sums[SummedAreaTable::EXACT_R] / pixels;
+        l._gAverage = sums[SummedAreaTable::EXACT_G] / pixels;
+        l._bAverage = sums[SummedAreaTable::EXACT_B] / pixels;
+        l._lumAverage = l._sum / l._areaSize;
+
+        // if value out of bounds
+        l._error = l._sum > maxLum;
+        l._sortCriteria = l._areaSize;
+
+        lights.push_back(l);
+    }
+}
@@ -1,109 +1,106 @@
 /* -*-c++-*- */
 
 /**
- * convert Env map Regions to Lights
+ * Light of a region from the sums of its pixels, as exactSums(): the
+ * luminance is weighted by the pixels solid angle and not normalized,
+ * weigth is the sum of the solid angles of the image
  */
-void createLightsFromRegions(const SatRegionVector& regions,
-                             LightVector& lights, const float* rgba,
-                             const double maxLum, const int width,
-                             const int height, const int nc,
-                             const SummedAreaTable& lumSat) {
-    const double maxR = lumSat.getMaxR();
-    const double maxG = lumSat.getMaxG();
-    const double maxB = lumSat.getMaxB();
-    const double weigth = lumSat.getWeightAccumulation();
-
+void createLight(const SatRegion& region,
+                 const double sums[SummedAreaTable::EXACT_COUNT],
+                 LightVector& lights, const float* rgba, const double maxLum,
+                 const int width, const int height, const int nc,
+                 const double weigth) {
     const uint imgSize = width * height;
     double weight = (4.0 * PI) / ((double)(imgSize));
 
-    // convert region into lights
-    for (SatRegionVector::const_iterator region = regions.begin();
-         region != regions.end(); ++region) {
-        Light l;
-
-        // init values
-        l._merged = false;
-        l._mergedNum = 0;
-
-        l._x = region->_x;
-        l._y = region->_y;
-        l._w = region->_w;
-        l._h = region->_h;
-
-        // set light at centroid
-        l._centroidPosition = region->centroid();
-
-        // light area Size
-        l._areaSize = region->areaSize();
-
-        const uint i = static_cast<uint>(l._centroidPosition[1] * width +
-                                         l._centroidPosition[0]);
-
-        // compute area values, as SAT introduce precision errors
-        // due to high sum values against small data values
-        // we use here less error inducing computations
-        double r = rgba[i * nc + 0];
-        double g = rgba[i * nc + 1];
-        double b = rgba[i * nc + 2];
-        {
-            double y =
-                ((double)l._centroidPosition[1] + 1.0) / (double)(height + 1);
-            double solidAngle = cos(PI * (y - 0.5)) * weight;
-            l._luminancePixel = luminance(r, g, b) * solidAngle;
-        }
-
-        double rSum = 0.0;
-        double gSum = 0.0;
-        double bSum = 0.0;
-        double lumSum = 0.0;
-
-        for (int y1 = l._y; y1 < l._y + l._h; ++y1) {
-            const double posY = ((double)y1 + 1.0) / (double)(height + 1.0);
-            const double solidAngle = cos(PI * (posY - 0.5)) * weight;
+    Light l;
+
+    // init values
+    l._merged = false;
+    l._mergedNum = 0;
+
+    l._x = region._x;
+    l._y = region._y;
+    l._w = region._w;
+    l._h = region._h;
+
+    // set light at centroid
+    l._centroidPosition = region.centroid();
+
+    // light area Size
+    l._areaSize = region.areaSize();
+
+    const uint i = static_cast<uint>(l._centroidPosition[1] * width +
+                                     l._centroidPosition[0]);
+
+    // the area values come from the fixed point table, the luminance
+    // table introduces precision errors due to high sum values against
+    // small data values
+    double r = rgba[i * nc + 0];
+    double g = rgba[i * nc + 1];
+    double b = rgba[i * nc + 2];
+    {
+        double y =
+            ((double)l._centroidPosition[1] + 1.0) / (double)(height + 1);
+        double solidAngle = cos(PI * (y - 0.5)) * weight;
+        l._luminancePixel = luminance(r, g, b) * solidAngle;
+    }
 
-            for (int x1 = l._x; x1 < l._x + l._w; ++x1) {
-                const uint i = (x1 + (y1 * width)) * nc;
+    double lumSum = sums[SummedAreaTable::EXACT_LUM];
+    const double rSum = sums[SummedAreaTable::EXACT_R];
+    const double gSum = sums[SummedAreaTable::EXACT_G];
+    const double bSum = sums[SummedAreaTable::EXACT_B];
 
-                r = rgba[i];
-                g = rgba[i + 1];
-                b = rgba[i + 2];
+    // normalize
+    lumSum *= (4.0 * PI) / weigth;
+    l._sum = lumSum;
 
-                lumSum += luminance(r, g, b) * solidAngle;
+    l._variance =
+        ((l._sum * l._sum) / l._areaSize) - (l._lumAverage * l._lumAverage);
 
-                rSum += r;
-                gSum += g;
-                bSum += b;
-            }
-        }
+    // Colors
+    l._rAverage = rSum / l._areaSize;
+    l._gAverage = gSum / l._areaSize;
+    l._bAverage = bSum / l._areaSize;
+    l._lumAverage = lumSum / l._areaSize;
 
-        // normalize
-        lumSum *= (4.0 * PI) / weigth;
-        l._sum = lumSum;
+    // make all value 0..1 now
+    l._x = static_cast<double>(l._x) / (double)width;
+    l._y = static_cast<double>(l._y) / (double)height;
+    l._w = static_cast<double>(l._w) / (double)width;
+    l._h = static_cast<double>(l._h) / (double)height;
+    l._areaSize = l._w * l._h;
 
-        l._variance =
-            ((l._sum * l._sum) / l._areaSize) - (l._lumAverage * l._lumAverage);
+    l._centroidPosition[0] = l._centroidPosition[0] / (double)width;
+    l._centroidPosition[1] = l._centroidPosition[1] / (double)height;
 
-        // Colors
-        l._rAverage = rSum / l._areaSize;
-        l._gAverage = gSum / l._areaSize;
-        l._bAverage = bSum / l._areaSize;
-        l._lumAverage = lumSum / l._areaSize;
+    // if value out of bounds
+    l._error = l._sum > maxLum;
+    l._sortCriteria = l._areaSize;
 
-        // make all value 0..1 now
-        l._x = static_cast<double>(l._x) / (double)width;
-        l._y = static_cast<double>(l._y) / (double)height;
-        l._w = static_cast<double>(l._w) / (double)width;
-        l._h = static_cast<double>(l._h) / (double)height;
-        l._areaSize = l._w * l._h;
+    lights.push_back(l);
+}
 
-        l._centroidPosition[0] = l._centroidPosition[0] / (double)width;
-        l._centroidPosition[1] = l._centroidPosition[1] / (double)height;
+/**
+ * convert Env map Regions to Lights
+ */
+void createLightsFromRegions(const SatRegionVector& regions,
+                             LightVector& lights, const float* rgba,
+                             const double maxLum, const int width,
+                             const int height, const int nc,
+                             const SummedAreaTable& lumSat) {
+    const double weigth = lumSat.getWeightAccumulation();
 
-        // if value out of bounds
-        l._error = l._sum > maxLum;
-        l._sortCriteria = l._areaSize;
+    // convert region into lights
+    for (SatRegionVector::const_iterator region = regions.begin();
+         region != regions.end(); ++region) {
+        // exact sums of the region pixels
+        double sums[SummedAreaTable::EXACT_COUNT];
+        lumSat.exactSums(region->_x, region->_y, region->_w, region->_h,
+                         sums);
 
-        lights.push_back(l);
+        createLight(*region, sums, lights, rgba, maxLum, width, height, nc,
+                    weigth);
     }
 }
 
@@ -204,6 +201,113 @@ bool intersectLightAgainstLights2D(const LightVector& lights,
     return false;
 }
 
+/*
+ * uniform grid over the lights rectangles, in 0..1 coordinates.
+ * Each cell lists the lights overlapping it so a merge only tests the
+ * lights near the merged rectangle. Merged lights are removed from the
+ * cells.
+ */
+struct LightGrid {
+    int _size;
+    std::vector<std::vector<uint> > _cells;
+
+    LightGrid(const LightVector& lights) {
+        // about one light per cell
+        _size = std::max(1, std::min(256, (int)ceil(sqrt(lights.size()))));
+        _cells.resize(_size * _size);
+
+        for (uint i = 0; i < lights.size(); ++i) {
+            int cells[4];
+            range(lights[i], cells);
+
+            for (int y = cells[1]; y <= cells[3]; ++y)
+                for (int x = cells[0]; x <= cells[2]; ++x)
+                    _cells[y * _size + x].push_back(i);
+        }
+    }
+
+    // the lights don't move so their cells are found from their rectangle
+    void remove(uint index, const Light& light) {
+        int cells[4];
+        range(light, cells);
+
+        for (int y = cells[1]; y <= cells[3]; ++y)
+            for (int x = cells[0]; x <= cells[2]; ++x) {
+                std::vector<uint>& c = _cells[y * _size + x];
+                c.erase(std::find(c.begin(), c.end(), index));
+            }
+    }
+
+    // coordinates out of the map, as the rectangle borders, are clamped.
+    // The merged rectangles can't wrap around the seam so there is no
+    // wrapping in x either
+    int cell(double v) const {
+        const int c = (int)floor(v * _size);
+        return std::max(0, std::min(_size - 1, c));
+    }
+
+    void range(const Light& l, int cells[4]) const {
+        range(l._x, l._y, l._x + l._w, l._y + l._h, cells);
+    }
+
+    // cells range of the lights that can be merged into a light: they
+    // intersect its borders and the merged light is under the max length.
+    // The range is a bit larger than the exact tests
+    void range(const Light& l, double border, double lengthSizeMax,
+               int cells[4]) const {
+        const double eps = 1e-6;
+        const double x1 = l._x - border;
+        const double y1 = l._y - border;
+        range(std::max(x1, l._x + l._w - lengthSizeMax) - eps,
+              std::max(y1, l._y + l._h - lengthSizeMax) - eps,
+              std::min(x1 + l._w + border, l._x + lengthSizeMax) + eps,
+              std::min(y1 + l._h + border, l._y + lengthSizeMax) + eps, cells);
+    }
+
+    // cells range of a rectangle
+    void range(double x1, double y1, double x2, double y2, int cells[4]) const {
+        cells[0] = cell(x1);
+        cells[1] = cell(y1);
+        cells[2] = cell(x2);
+        cells[3] = cell(y2);
+    }
+
+    // sorted indices of the lights in a cells range
+    void query(const int cells[4], std::vector<uint>& indices) const {
+        indices.clear();
+
+        for (int y = cells[1]; y <= cells[3]; ++y)
+            for (int x = cells[0]; x <= cells[2]; ++x) {
+                const std::vector<uint>& c = _cells[y * _size + x];
+                indices.insert(indices.end(), c.begin(), c.end());
+            }
+
+        std::sort(indices.begin(), indices.end());
+        indices.erase(std::unique(indices.begin(), indices.end()),
+                      indices.end());
+    }
+
+    // sorted indices after a given one of the lights in the cells of a
+    // range that were not in the previous range
+    void queryGrown(const int previous[4], const int cells[4], uint after,
+                    std::vector<uint>& indices) const {
+        indices.clear();
+
+        for (int y = cells[1]; y <= cells[3]; ++y)
+            for (int x = cells[0]; x <= cells[2]; ++x) {
+                if (x >= previous[0] && x <= previous[2] &&
+                    y >= previous[1] && y <= previous[3])
+                    continue;
+
+                const std::vector<uint>& c = _cells[y * _size + x];
+                for (size_t i = 0; i < c.size(); ++i)
+                    if (c[i] > after) indices.push_back(c[i]);
+            }
+
+        std::sort(indices.begin(), indices.end());
+    }
+};
+
 /**
  * Merge small area light neighbour with small area light neighbours
  */
@@ -218,11 +322,16 @@ uint mergeLights(LightVector& lights, LightVector& newLights, const uint width,
 
     numMergedLightTotal = 0;
 
+    LightGrid grid(lights);
+    std::vector<uint> candidates, remaining, added;
+
     // for each light we try to merge with all other intersecting lights
     // that are in the same neighborhood of the sorted list of lights
     // where neighbors are of near same values
     for (LightVector::iterator lightIt = lights.begin();
          lightIt != lights.end(); ++lightIt) {
+        const int current = lightIt - lights.begin();
+
         // already merged in a previous light
         // we do nothing
         if (lightIt->_merged) continue;
@@ -244,15 +353,22 @@ uint mergeLights(LightVector& lights, LightVector& newLights, const uint width,
         do {
             numMergedLight = 0;
 
-            // could start at current light
-            // lights is sorted by areasize from small to big
-            for (LightVector::iterator l = lights.begin(); l != lights.end();
-                 ++l) {
+            // lights are tested in their order, as with a scan of all the
+            // lights. When a merge changes the cells range, the lights of
+            // the new cells are added to the remaining candidates
+            int cells[4];
+            grid.range(lCurrent, border, lengthSizeMax, cells);
+            grid.query(cells, candidates);
+
+            for (size_t c = 0; c < candidates.size();) {
+                const uint index = candidates[c++];
+                Light* l = &lights[index];
+
                 // ignore already merged into another
                 if (l->_merged) continue;
 
                 // ignore itself
-                if (l == lightIt) continue;
+                if (int(index) == current) continue;
 
                 // if merged do new size will be problematic
                 const double newX = std::min(lCurrent._x, l->_x);
@@ -269,35 +385,11 @@ uint mergeLights(LightVector& lights, LightVector& newLights, const uint width,
 
                 bool intersect2D = !(l->_y > y2 || l->_y + l->_h < y1 ||
                                      l->_x > x2 || l->_x + l->_w < x1);
-                // try left/right border as it's a env wrap
-                // complexity arise, how to merge...and then retest after
-                /*
-                  if (!intersect2D ){
-                  if( x == 0 ){
-                  //check left borders
-                  intersect2D = !(l->_y-border > y+h || l->_y+l->_h+border < y
-                  || l->_x-border > width + w || l->_x+l->_w+border < width);
-                  }else if( x+w == width ){
-                  //check right borders
-                  intersect2D = !(l->_y-border > y+h || l->_y+l->_h+border < y
-                  || l->_x-border > w + (width - x) || l->_x+l->_w+border <
-                  (width - x));
-                  }
-                  }
-                */
 
                 //  share borders
                 if (intersect2D) {
-                    // remove from previous merge if any
-                    for (LightVector::iterator lBigIt = newLights.begin();
-                         lBigIt != newLights.end(); ++lBigIt) {
-                        if (l == lBigIt) {
-                            newLights.erase(lBigIt);
-                            break;
-                        }
-                    }
-
                     mergeLight(lCurrent, *l);
+                    grid.remove(index, *l);
 
                     x1 = lCurrent._x - border;
                     y1 = lCurrent._y - border;
@@ -306,6 +398,27 @@ uint mergeLights(LightVector& lights, LightVector& newLights, const uint width,
 
                     numMergedLight++;
                     numMergedLightTotal++;
+
+                    int grown[4];
+                    grid.range(lCurrent, border, lengthSizeMax, grown);
+                    if (!std::equal(grown, grown + 4, cells)) {
+                        // add the lights of the new cells after the merged
+                        // one to the remaining candidates
+                        grid.queryGrown(cells, grown, index, added);
+                        remaining.assign(candidates.begin() + c,
+                                         candidates.end());
+
+                        candidates.clear();
+                        std::merge(remaining.begin(), remaining.end(),
+                                   added.begin(), added.end(),
+                                   std::back_inserter(candidates));
+                        candidates.erase(
+                            std::unique(candidates.begin(), candidates.end()),
+                            candidates.end());
+
+                        std::copy(grown, grown + 4, cells);
+                        c = 0;
+                    }
                 }
             }
 
@@ -0,0 +1,466 @@
+/* -*-c++-*- */
+
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+
+#include <float.h>
+#include <algorithm>
+#include <vector>
+#include "Light"
+#include "Math"
+
+/**
+ * 2x2 box filter of an image into the next pyramid level, rgb only.
+ * An odd last row or column is averaged with itself
+ */
+struct DownsampleRows {
+    const float* _src;
+    uint _srcWidth, _srcHeight, _nc;
+    float* _dst;
+    uint _width;
+
+    void operator()(const tbb::blocked_range<uint>& r) const {
+        for (uint y = r.begin(); y != r.end(); ++y) {
+            const uint y0 = y * 2;
+            const uint y1 = std::min(y0 + 1, _srcHeight - 1);
+            const float* row0 = _src + size_t(y0) * _srcWidth * _nc;
+            const float* row1 = _src + size_t(y1) * _srcWidth * _nc;
+            float* dst = _dst + size_t(y) * _width * 3;
+
+            for (uint x = 0; x < _width; ++x) {
+                const uint x0 = x * 2 * _nc;
+                const uint x1 = std::min(x * 2 + 1, _srcWidth - 1) * _nc;
+
+                for (uint c = 0; c < 3; ++c) {
+                    dst[x * 3 + c] = (row0[x0 + c] + row0[x1 + c] +
+                                      row1[x0 + c] + row1[x1 + c]) *
+                                     0.25f;
+                }
+            }
+        }
+    }
+};
+
+/**
+ * Box filter of an image to a smaller size, each pixel is the mean of the
+ * source pixels it covers weighted by their covered part. Used for the last
+ * reduction of a level, less than a halving, rgb only
+ */
+struct ResampleRows {
+    const float* _src;
+    uint _srcWidth, _srcHeight, _nc;
+    float* _dst;
+    uint _width, _height;
+
+    void operator()(const tbb::blocked_range<uint>& r) const {
+        const double scaleX = (double)_srcWidth / (double)_width;
+        const double scaleY = (double)_srcHeight / (double)_height;
+
+        for (uint y = r.begin(); y != r.end(); ++y) {
+            const double y0 = y * scaleY;
+            const double y1 = (y + 1) * scaleY;
+            float* dst = _dst + size_t(y) * _width * 3;
+
+            for (uint x = 0; x < _width; ++x) {
+                const double x0 = x * scaleX;
+                const double x1 = (x + 1) * scaleX;
+                double sum[3] = {0.0, 0.0, 0.0};
+
+                for (uint sy = uint(y0); sy < y1 && sy < _srcHeight; ++sy) {
+                    const double wy =
+                        std::min(y1, sy + 1.0) - std::max(y0, (double)sy);
+                    const float* row = _src + size_t(sy) * _srcWidth * _nc;
+
+                    for (uint sx = uint(x0); sx < x1 && sx < _srcWidth;
+                         ++sx) {
+                        const double w = wy * (std::min(x1, sx + 1.0) -
+                                               std::max(x0, (double)sx));
+                        for (uint c = 0; c < 3; ++c)
+                            sum[c] += row[sx * _nc + c] * w;
+                    }
+                }
+
+                for (uint c = 0; c < 3; ++c)
+                    dst[x * 3 + c] = float(sum[c] / (scaleX * scaleY));
+            }
+        }
+    }
+};
+
+/**
+ * Reduce the image to maxWidth wide, 0 keeps the image. It's halved while
+ * it stays as wide as maxWidth then resampled to maxWidth, so a 3000 or a
+ * 1536 wide image is cut 1024 wide and not 750 or 768.
+ * level receives the reduced image, returns the number of pixels of the
+ * image per pixel of the level, 1 when the image is kept
+ */
+double downsampleLevel(const float* rgba, const uint width, const uint height,
+                       const uint nc, const uint maxWidth,
+                       std::vector<float>& level, uint& levelWidth,
+                       uint& levelHeight) {
+    levelWidth = width;
+    levelHeight = height;
+
+    const float* src = rgba;
+    uint srcNc = nc;
+    std::vector<float> previous;
+
+    while (maxWidth > 0 && (levelWidth + 1) / 2 >= maxWidth &&
+           levelHeight > 1) {
+        DownsampleRows downsample;
+        downsample._src = src;
+        downsample._srcWidth = levelWidth;
+        downsample._srcHeight = levelHeight;
+        downsample._nc = srcNc;
+        downsample._width = (levelWidth + 1) / 2;
+
+        levelHeight = (levelHeight + 1) / 2;
+        level.resize(size_t(downsample._width) * levelHeight * 3);
+        downsample._dst = &level[0];
+
+        tbb::parallel_for(tbb::blocked_range<uint>(0, levelHeight), downsample);
+
+        levelWidth = downsample._width;
+
+        level.swap(previous);
+        src = &previous[0];
+        srcNc = 3;
+    }
+
+    if (maxWidth > 0 && levelWidth > maxWidth) {
+        ResampleRows resample;
+        resample._src = src;
+        resample._srcWidth = levelWidth;
+        resample._srcHeight = levelHeight;
+        resample._nc = srcNc;
+        resample._width = maxWidth;
+        resample._height = std::max(
+            1u, uint(floor((double)levelHeight * maxWidth / levelWidth + 0.5)));
+
+        level.resize(size_t(resample._width) * resample._height * 3);
+        resample._dst = &level[0];
+
+        tbb::parallel_for(tbb::blocked_range<uint>(0, resample._height),
+                          resample);
+
+        levelWidth = resample._width;
+        levelHeight = resample._height;
+        level.swap(previous);
+    }
+
+    if (levelWidth == width) return 1.0;
+
+    level.swap(previous);
+    return (double)width / (double)levelWidth;
+}
+
+/**
+ * Prefix sums of the rows of the full resolution luminance, weighted by the
+ * pixels solid angle as the fixed point table. A region sum reads two values
+ * per row, it's enough for the few sums of a refinement and the image is
+ * read once instead of building its tables
+ */
+struct LumRows {
+    uint _width, _height;
+    std::vector<double> _rows;  // _width + 1 sums per row, the first is 0
+    double _min;                // darkest weighted pixel
+    double _weightAccum;        // sum of the pixels solid angles
+
+    void create(const float* rgba, const uint width, const uint height,
+                const uint nc);
+
+    // sum of the w x h region at (x, y)
+    double sum(const int x, const int y, const int w, const int h) const {
+        double s = 0.0;
+        for (int row = y; row < y + h; ++row) {
+            const double* r = &_rows[size_t(row) * (_width + 1)];
+            s += r[x + w] - r[x];
+        }
+        return s;
+    }
+
+    // sum of the region with the darkest pixel as 0, as the luminance table
+    // values are shifted to enhance its precision. The range the table
+    // scales them by doesn't change the median
+    double shiftedSum(const int x, const int y, const int w,
+                      const int h) const {
+        if (w <= 0 || h <= 0) return 0.0;
+        return sum(x, y, w, h) - double(w) * double(h) * _min;
+    }
+
+    // normalized sum of the image, as SummedAreaTable::getSum()
+    double getSum() const {
+        return sum(0, 0, _width, _height) * (4.0 * PI) / _weightAccum;
+    }
+};
+
+struct LumRowScan {
+    const float* _rgba;
+    uint _width, _height, _nc;
+    double _weight;
+    double* _rows;
+    double* _rowsMin;
+
+    void operator()(const tbb::blocked_range<uint>& r) const {
+        for (uint y = r.begin(); y != r.end(); ++y) {
+            // same solid angle than the luminance table
+            const double posY = (double)(y + 1.0) / (double)(_height + 1.0);
+            const double solidAngle = cos(PI * (posY - 0.5)) * _weight;
+
+            const float* pixel = _rgba + size_t(y) * _width * _nc;
+            double* row = _rows + size_t(y) * (_width + 1);
+            double sum = 0.0;
+            double min = DBL_MAX;
+
+            row[0] = 0.0;
+            for (uint x = 0; x < _width; ++x, pixel += _nc) {
+                const double v =
+                    luminance<double>(pixel[0], pixel[1], pixel[2]) *
+                    solidAngle;
+                min = std::min(min, v);
+                sum += v;
+                row[x + 1] = sum;
+            }
+            _rowsMin[y] = min;
+        }
+    }
+};
+
+void LumRows::create(const float* rgba, const uint width, const uint height,
+                     const uint nc) {
+    _width = width;
+    _height = height;
+    _rows.resize(size_t(width + 1) * height);
+    std::vector<double> rowsMin(height);
+
+    LumRowScan scan;
+    scan._rgba = rgba;
+    scan._width = width;
+    scan._height = height;
+    scan._nc = nc;
+    scan._weight = (4.0 * PI) / ((double)width * height);
+    scan._rows = &_rows[0];
+    scan._rowsMin = &rowsMin[0];
+
+    tbb::parallel_for(tbb::blocked_range<uint>(0, height), scan);
+
+    _min = *std::min_element(rowsMin.begin(), rowsMin.end());
+
+    _weightAccum = 0.0;
+    for (uint y = 0; y < height; ++y) {
+        const double posY = (double)(y + 1.0) / (double)(height + 1.0);
+        _weightAccum += cos(PI * (posY - 0.5)) * scan._weight * width;
+    }
+}
+
+/**
+ * Median cut of the full resolution image guided by a level. A split is
+ * searched first within a pixel of the level around the split of the region
+ * in the level, and over the whole region when the median is out of it, so
+ * the regions are the ones of a full resolution cut. The sums are read from
+ * the rows of the full resolution luminance, there is no table to build.
+ */
+struct RefineCut {
+    const SummedAreaTable& _level;
+    const LumRows& _lum;
+    double _scaleX, _scaleY;
+    SatRegionVector& _regions;
+
+    RefineCut(const SummedAreaTable& level, const LumRows& lum,
+              SatRegionVector& regions)
+        : _level(level),
+          _lum(lum),
+          _scaleX((double)lum._width / level.width()),
+          _scaleY((double)lum._height / level.height()),
+          _regions(regions) {}
+
+    // full resolution region of a level region
+    void scale(const SatRegion& r, SatRegion& f) const {
+        const int x1 = std::min(int(_lum._width),
+                                int(floor((r._x + r._w) * _scaleX + 0.5)));
+        const int y1 = std::min(int(_lum._height),
+                                int(floor((r._y + r._h) * _scaleY + 0.5)));
+
+        f._sat = 0;
+        f._x = int(floor(r._x * _scaleX + 0.5));
+        f._y = int(floor(r._y * _scaleY + 0.5));
+        f._w = x1 - f._x;
+        f._h = y1 - f._y;
+    }
+
+    // energy of the left or top part of f of a size, the sums of the regions
+    // skip their first row and column as SummedAreaTable::sum()
+    double part(const SatRegion& f, const bool vertical, const int size) const {
+        return vertical
+                   ? _lum.shiftedSum(f._x + 1, f._y + 1, size - 1, f._h - 1)
+                   : _lum.shiftedSum(f._x + 1, f._y + 1, f._w - 1, size - 1);
+    }
+
+    // size of the left or top part of f at the split of the level region
+    int guess(const SatRegion& f, const bool vertical) const {
+        const int x0 = int(f._x / _scaleX);
+        const int y0 = int(f._y / _scaleY);
+        const int x1 = std::min(int(_level.width()),
+                                int(ceil((f._x + f._w) / _scaleX)));
+        const int y1 = std::min(int(_level.height()),
+                                int(ceil((f._y + f._h) / _scaleY)));
+
+        SatRegion r, A;
+        r.create(x0, y0, std::max(1, x1 - x0), std::max(1, y1 - y0), &_level);
+
+        if (vertical) {
+            r.split_w(A);
+            return int(floor((x0 + A._w) * _scaleX + 0.5)) - f._x;
+        }
+
+        r.split_h(A);
+        return int(floor((y0 + A._h) * _scaleY + 0.5)) - f._y;
+    }
+
+    // smallest left or top part of f with at least half the energy, as
+    // SatRegion::split_w and split_h
+    int split(const SatRegion& f, const bool vertical) const {
+        const int size = vertical ? f._w : f._h;
+        const double margin = ceil(vertical ? _scaleX : _scaleY);
+        const double sum = part(f, vertical, size);
+
+        const int split = guess(f, vertical);
+        int lo = std::max(1, std::min(size, int(split - margin)));
+        int hi = std::max(lo, std::min(size, int(split + margin)));
+
+        // the part grows with its size, the median is before, in or after
+        // the window
+        if (part(f, vertical, lo) * 2.0 >= sum) {
+            hi = lo;
+            lo = 1;
+        } else if (part(f, vertical, hi) * 2.0 < sum) {
+            lo = hi + 1;
+            hi = size;
+        } else {
+            lo++;
+        }
+
+        while (lo < hi) {
+            const int s = (lo + hi) / 2;
+            if (part(f, vertical, s) * 2.0 >= sum)
+                hi = s;
+            else
+                lo = s + 1;
+        }
+        return std::min(lo, size);
+    }
+
+    // split f as splitRecursive
+    void split(const SatRegion& f, const uint n) const {
+        if (f._w < 2 || f._h < 2 || n == 0) {
+            _regions.push_back(f);
+            return;
+        }
+
+        SatRegion A = f, B = f;
+
+        if (f._w > f._h) {
+            A._w = split(f, true);
+            B._x = f._x + (A._w - 1);
+            B._w = f._w - A._w;
+        } else {
+            A._h = split(f, false);
+            B._y = f._y + (A._h - 1);
+            B._h = f._h - A._h;
+        }
+
+        if (A._h > 2 && A._w > 2) split(A, n - 1);
+        if (B._h > 2 && B._w > 2) split(B, n - 1);
+    }
+};
+
+/**
+ * Regions of the full resolution image from the cut of a level, see
+ * RefineCut. The variance splits need the moments tables, the regions of a
+ * variance cut are scaled.
+ */
+void refineRegions(const SummedAreaTable& level, const SatRegionVector& regions,
+                   const LumRows& lum, const uint n, const bool variance,
+                   SatRegionVector& refined) {
+    refined.clear();
+
+    RefineCut refine(level, lum, refined);
+
+    if (variance) {
+        refined.resize(regions.size());
+        for (size_t i = 0; i < regions.size(); ++i)
+            refine.scale(regions[i], refined[i]);
+        return;
+    }
+
+    SatRegion f;
+    f._sat = 0;
+    f._x = 0;
+    f._y = 0;
+    f._w = lum._width;
+    f._h = lum._height;
+    refine.split(f, n);
+}
+
+/**
+ * Sums of the full resolution regions as exactSums(), the colors are summed
+ * from the pixels
+ */
+struct RegionSums {
+    const SatRegion* _regions;
+    const LumRows* _lum;
+    const float* _rgba;
+    uint _nc;
+    double* _sums;
+
+    void operator()(const tbb::blocked_range<size_t>& range) const {
+        const uint width = _lum->_width;
+
+        for (size_t i = range.begin(); i != range.end(); ++i) {
+            const SatRegion& region = _regions[i];
+            double* sums = _sums + i * SummedAreaTable::EXACT_COUNT;
+            double r = 0.0, g = 0.0, b = 0.0;
+
+            for (int y = region._y; y < region._y + region._h; ++y) {
+                const float* pixel =
+                    _rgba + (size_t(y) * width + region._x) * _nc;
+                for (int x = 0; x < region._w; ++x, pixel += _nc) {
+                    r += pixel[0];
+                    g += pixel[1];
+                    b += pixel[2];
+                }
+            }
+
+            sums[SummedAreaTable::EXACT_LUM] =
+                _lum->sum(region._x, region._y, region._w, region._h);
+            sums[SummedAreaTable::EXACT_R] = r;
+            sums[SummedAreaTable::EXACT_G] = g;
+            sums[SummedAreaTable::EXACT_B] = b;
+        }
+    }
+};
+
+/**
+ * convert the full resolution regions of refineRegions() to Lights
+ */
+void createLightsFromRefinedRegions(const SatRegionVector& regions,
+                                    LightVector& lights, const float* rgba,
+                                    const double maxLum, const LumRows& lum,
+                                    const uint nc) {
+    std::vector<double> sums(regions.size() * SummedAreaTable::EXACT_COUNT);
+
+    RegionSums regionSums;
+    regionSums._regions = regions.empty() ? 0 : &regions[0];
+    regionSums._lum = &lum;
+    regionSums._rgba = rgba;
+    regionSums._nc = nc;
+    regionSums._sums = sums.empty() ? 0 : &sums[0];
+
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, regions.size()),
+                      regionSums);
+
+    for (size_t i = 0; i < regions.size(); ++i)
+        createLight(regions[i], &sums[i * SummedAreaTable::EXACT_COUNT],
+                    lights, rgba, maxLum, lum._width, lum._height, nc,
+                    lum._weightAccum);
+}
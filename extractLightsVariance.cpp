@@ -10,6 +10,7 @@
 #include <algorithm>
 #include <cassert>
 #include <iostream>
+#include <iterator>
 #include <vector>
 
 #include <OpenImageIO/filter.h>
@@ -17,22 +18,51 @@
 #include <OpenImageIO/imagebufalgo.h>
 #include <OpenImageIO/imageio.h>
 
+#include <tbb/task_group.h>
+
 OIIO_NAMESPACE_USING
 
+#include "Cubemap"
 #include "Light"
 #include "Math"
 #include "SummedAreaTable"
 #include "SummedAreaTableRegion"
 
+void splitRecursive(const SatRegion& r, const uint n, SatRegionVector& regions,
+                    bool variance);
+
+#include "extractLightsCube.cpp"
 #include "extractLightsMerge.cpp"
+#include "extractLightsPyramid.cpp"
 #include "extractLightsVarianceDebug.cpp"
 
+// regions smaller than this are split by the task that made them
+#define SPLIT_TASK_AREA (128 * 128)
+
+struct SplitTask {
+    const SatRegion& _region;
+    uint _n;
+    SatRegionVector& _regions;
+    bool _variance;
+
+    SplitTask(const SatRegion& region, uint n, SatRegionVector& regions,
+              bool variance)
+        : _region(region), _n(n), _regions(regions), _variance(variance) {}
+
+    void operator()() const {
+        splitRecursive(_region, _n, _regions, _variance);
+    }
+};
+
 /**
  * Recursively split a region r and append new subregions
  * A and B to regions vector when at an end.
+ * Large halves are split in parallel, B in a task with its own vector
+ * appended after the A regions, so the order doesn't depend on the
+ * scheduling.
  */
 void splitRecursive(const SatRegion& r, const uint n,
-                    SatRegionVector& regions) {
+                    SatRegionVector& regions, bool variance) {
     // check: can't split any further?
     if (r._w < 2 || r._h < 2 || n == 0) {
         // only now add region
@@ -43,16 +73,30 @@ void splitRecursive(const SatRegion& r, const uint n,
     SatRegion A, B;
 
     if (r._w > r._h)
-        r.split_w(A, B);
+        r.split_w(A, B, variance);
     else
-        r.split_h(A, B);
+        r.split_h(A, B, variance);
+
+    const bool splitA = A._h > 2 && A._w > 2;
+    const bool splitB = B._h > 2 && B._w > 2;
 
-    if (A._h > 2 && A._w > 2) {
-        splitRecursive(A, n - 1, regions);
+    if (splitA && splitB && r.areaSize() >= SPLIT_TASK_AREA) {
+        SatRegionVector regionsB;
+        tbb::task_group group;
+        group.run(SplitTask(B, n - 1, regionsB, variance));
+        splitRecursive(A, n - 1, regions, variance);
+        group.wait();
+
+        regions.insert(regions.end(), regionsB.begin(), regionsB.end());
+        return;
+    }
+
+    if (splitA) {
+        splitRecursive(A, n - 1, regions, variance);
     }
 
-    if (B._h > 2 && B._w > 2) {
-        splitRecursive(B, n - 1, regions);
+    if (splitB) {
+        splitRecursive(B, n - 1, regions, variance);
     }
 }
 
@@ -62,9 +106,11 @@ void splitRecursive(const SatRegion& r, const uint n,
  * img - Summed area table of an image
  * n - number of subdivision, yields 2^n cuts
  * regions - an empty vector that gets filled with generated regions
+ * variance - variance minimisation instead of median cut, img needs the log
+ * table
  */
 void medianVarianceCut(const SummedAreaTable& img, const uint n,
-                       SatRegionVector& regions) {
+                       SatRegionVector& regions, bool variance) {
     regions.clear();
 
     // insert entire image as start region
@@ -72,7 +118,7 @@ void medianVarianceCut(const SummedAreaTable& img, const uint n,
     r.create(0, 0, img.width(), img.height(), &img);
 
     // recursively split into subregions
-    splitRecursive(r, n, regions);
+    splitRecursive(r, n, regions, variance);
 }
 
 void outputJSON(const LightVector& lights, uint height, uint width,
@@ -147,7 +193,8 @@ void outputJSON(const LightVector& lights, uint height, uint width,
 static int usage(const std::string& name) {
     std::cerr << "Usage: " << name
               << " [-a max_light_areas] [-l max_light_length] [-r ratioLight] "
-                 "[-n numCuts] [-m lightsNum] [-d] file.hdr"
+                 "[-n numCuts] [-m lightsNum] [-s cutWidth] [-c] [-d] [-v] "
+                 "file.hdr|cubemap.tif"
               << std::endl;
     return 1;
 }
@@ -157,7 +204,7 @@ static int usage(const std::string& name) {
 // some examples scripts here for multi or single update:
 // https://gist.github.com/Kuranes/fa7466291c9fad3cdfb845f80fabe646
 // Eg: extractLights [-a max_light_areas] [-l max_light_length] [-r ratioLight]
-// [-n numCuts] [-d] [-m num_lights] file.hdr|exr
+// [-n numCuts] [-s cut_width] [-c] [-d] [-v] [-m num_lights] file.hdr|exr
 int main(int argc, char** argv) {
     // max area encased by light extracted, ratio of env map size
     // default is using Area of 1% of EnvMap as dir approx light
@@ -177,15 +224,22 @@ int main(int argc, char** argv) {
         0.5f;  // ratio of lightExtracted On Global Illumination sum
     int numCuts =
         8;  // number of division squared of the envmap of same lighting power
+    // max width of the image level cut, 0 cuts the full resolution image
+    int cutWidth = 0;
 
     int c;
     bool debug = false;
+    bool variance = false;
+    bool cube = false;
 
-    while ((c = getopt(argc, argv, "a:dl:m:n:r:")) != -1) {
+    while ((c = getopt(argc, argv, "a:cdl:m:n:r:s:v")) != -1) {
         switch (c) {
             case 'a':
                 ratioAreaSizeMax = atof(optarg);
                 break;
+            case 'c':
+                cube = true;
+                break;
             case 'd':
                 debug = true;
                 break;
@@ -201,46 +255,115 @@ int main(int argc, char** argv) {
             case 'r':
                 ratioLuminanceLight = atof(optarg);
                 break;
+            case 's':
+                cutWidth = atoi(optarg);
+                break;
+            case 'v':
+                variance = true;
+                break;
 
             default:
                 return usage(argv[0]);
         }
     }
 
-    if (optind < argc) {
-        ////////////////////////////////////////////////
-        // load image
-        int width, height, nc;
-        float* rgba;
+    // the faces of a cubemap are cut in place at their size, there is no
+    // level to draw the regions on nor to reduce
+    if (cube && (debug || cutWidth > 0)) return usage(argv[0]);
 
-        ImageInput* input = ImageInput::open(argv[optind]);
-
-        if (!input) {
-            std::cerr << "Cannot open " << argv[1] << " image file"
-                      << std::endl;
-            return 1;
-        }
+    if (optind < argc) {
+        // the median cut only needs the luminance, the variance one the log.
+        // The lights sums are read from the fixed point table
+        uint moments =
+            SummedAreaTable::MOMENT_LUM | SummedAreaTable::MOMENT_EXACT;
+        if (variance) moments |= SummedAreaTable::MOMENT_LOG;
 
-        const ImageSpec& spec(input->spec());
-        width = spec.width;
-        height = spec.height;
-        nc = spec.nchannels;
-        const uint imageAreaSize = width * height;
-        rgba = new float[imageAreaSize * nc];
-        input->read_image(TypeDesc::FLOAT, rgba);
-        input->close();
+        SatRegionVector regions;
 
-        ////////////////////////////////////////////////
-        // create summed area table of luminance image
+        // panorama, the level it's cut at and its table
+        int width = 0, height = 0, nc = 0;
+        uint imageAreaSize = 0;
+        float* rgba = 0;
+        std::vector<float> level;
+        uint levelWidth = 0, levelHeight = 0;
+        double levelScale = 1.0;
+        float* cutRgba = 0;
+        uint cutNc = 0;
         SummedAreaTable lum_sat;
 
-        lum_sat.createLum(rgba, width, height, nc);
-
-        ////////////////////////////////////////////////
-        // apply cut algorithm
-        SatRegionVector regions;
-
-        medianVarianceCut(lum_sat, numCuts, regions);  // max 2^n cuts
+        // full resolution regions and luminance of a cut level
+        SatRegionVector refined;
+        LumRows lumRows;
+
+        // cubemap and its faces tables
+        Cubemap cubemap;
+        SummedAreaTable faces[6];
+
+        if (cube) {
+            ////////////////////////////////////////////////
+            // the faces are cut in place, without converting the cubemap
+            if (!cubemap.load(argv[optind])) {
+                std::cerr << "Cannot open " << argv[optind] << " cubemap file"
+                          << std::endl;
+                return 1;
+            }
+
+            width = height = cubemap.getSize();
+            nc = cubemap.getSamplePerPixel();
+            imageAreaSize = 6 * width * height;
+
+            createCubeTables(cubemap, faces, moments);
+
+            // max 2^n cuts
+            cubeMedianVarianceCut(faces, numCuts, regions, variance);
+        } else {
+            ////////////////////////////////////////////////
+            // load image
+            ImageInput* input = ImageInput::open(argv[optind]);
+
+            if (!input) {
+                std::cerr << "Cannot open " << argv[1] << " image file"
+                          << std::endl;
+                return 1;
+            }
+
+            const ImageSpec& spec(input->spec());
+            width = spec.width;
+            height = spec.height;
+            nc = spec.nchannels;
+            imageAreaSize = width * height;
+            rgba = new float[imageAreaSize * nc];
+            input->read_image(TypeDesc::FLOAT, rgba);
+            input->close();
+
+            ////////////////////////////////////////////////
+            // the cut runs on a reduced level of the image, its regions
+            // are refined at full resolution
+            levelScale =
+                downsampleLevel(rgba, width, height, nc, std::max(cutWidth, 0),
+                                level, levelWidth, levelHeight);
+
+            cutRgba = levelScale > 1.0 ? &level[0] : rgba;
+            cutNc = levelScale > 1.0 ? 3 : nc;
+
+            ////////////////////////////////////////////////
+            // create summed area table of luminance image, the lights of a
+            // level are summed from the full resolution regions
+            if (levelScale > 1.0) moments &= ~SummedAreaTable::MOMENT_EXACT;
+            lum_sat.createLum(cutRgba, levelWidth, levelHeight, cutNc, moments);
+
+            ////////////////////////////////////////////////
+            // apply cut algorithm
+
+            // max 2^n cuts
+            medianVarianceCut(lum_sat, numCuts, regions, variance);
+
+            if (levelScale > 1.0) {
+                lumRows.create(rgba, width, height, nc);
+                refineRegions(lum_sat, regions, lumRows, numCuts, variance,
+                              refined);
+            }
+        }
 
         if (regions.empty()) {
             std::cerr << "Cannot cut " << argv[1] << " into light regions"
@@ -258,14 +381,22 @@ int main(int argc, char** argv) {
         // to relative to environment at hand value.
         // From ratio to pixel squared area
         /// Light Max luminance in percentage
-        double luminanceSum = lum_sat.getSum();
-        lum_sat.sum(0, 0, width - 1, 0, width - 1, height - 1, 0, height - 1);
+        double luminanceSum = cube ? cubeLuminanceSum(faces)
+                                   : levelScale > 1.0 ? lumRows.getSum()
+                                                      : lum_sat.getSum();
 
         const double luminanceMaxLight = ratioLuminanceLight * luminanceSum;
 
         // And he saw that light was good, and separated light from darkness
-        createLightsFromRegions(regions, lights, rgba, luminanceMaxLight, width,
-                                height, nc, lum_sat);
+        if (cube)
+            createLightsFromCubeRegions(regions, faces, lights,
+                                        luminanceMaxLight, cubemap);
+        else if (levelScale > 1.0)
+            createLightsFromRefinedRegions(refined, lights, rgba,
+                                           luminanceMaxLight, lumRows, nc);
+        else
+            createLightsFromRegions(regions, lights, cutRgba, luminanceMaxLight,
+                                    levelWidth, levelHeight, cutNc, lum_sat);
 
         // sort lights
         // the smaller, the more powerful luminance
@@ -286,9 +417,9 @@ int main(int argc, char** argv) {
 
         const double mergeAreaSize = areaSizeMax;
 
-        uint mergedLights =
-            mergeLights(lights, mainLights, width, height, mergeAreaSize,
-                        ratioLengthSizeMax, luminanceMaxLight, degreeMerge);
+        uint mergedLights = mergeLights(
+            lights, mainLights, levelWidth, levelHeight, mergeAreaSize,
+            ratioLengthSizeMax, luminanceMaxLight, degreeMerge);
 
         // sort By sum now (changed the sort Criteria during merge)
         // biggest Sum first
@@ -352,8 +483,9 @@ int main(int argc, char** argv) {
                    numLights);
 
         if (debug) {
-            debugDrawLight(regions, lights, mainLights, rgba, width, height, nc,
-                           lum_sat.getMaxLum(), lum_sat.getMinLum(), numLights);
+            debugDrawLight(regions, lights, mainLights, cutRgba, levelWidth,
+                           levelHeight, cutNc, lum_sat.getMaxLum(),
+                           lum_sat.getMinLum(), numLights);
         }
 
     } else {
@@ -122,10 +122,23 @@ class Prefilter:
 
         print "reading samples from file {} with {} levels ".format(sample_file, nb_levels)
         self.samples = []
+        self.samples_total_weight = []
         f = open(sample_file, 'rb')
+        # see PrecomputedLightTable for the layout
+        header = numpy.fromfile(f, dtype=numpy.uint32, count=8)
+        if header[0:1].tostring() != "GGXS" or header[1] != 1:
+            raise Exception("{} is not a samples file version 1".format(sample_file))
+        file_num_samples = header[2]
+        file_nb_levels = header[4]
+        if file_num_samples != num_samples or file_nb_levels < nb_levels:
+            raise Exception("{} has {} levels of {} samples".format(sample_file, file_nb_levels, file_num_samples))
+        levels = numpy.fromfile(f, dtype=[('roughness', numpy.float32),
+                                          ('reserved', numpy.float32),
+                                          ('total_weight', numpy.float64)], count=file_nb_levels)
         for i in range(nb_levels):
             array = numpy.fromfile(f, dtype=cl_array.vec.float4, count=num_samples)
             self.samples.append(array)
+            self.samples_total_weight.append(levels[i]['total_weight'])
 
         self.d_precomputed_lightvector_read = cl.Buffer(self.ctx,
                                                         cl.mem_flags.READ_ONLY,
@@ -135,9 +148,7 @@ class Prefilter:
 
         # predefined samples from file
         self.h_precomputed_light = self.samples[level-1]
-        sum_weight = 0.0
-        for i in self.h_precomputed_light:
-            sum_weight += i[2]
+        sum_weight = self.samples_total_weight[level-1]
 
         return {
             'sum': sum_weight,
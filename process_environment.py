@@ -162,28 +162,6 @@ class ProcessEnvironment(object):
         else:
             json.dump(config, output)
 
-    def fix_source_environment(self, input, output):
-        """ Clean +inf nan from the environment"""
-        # iinfo rely openimageio
-        cmd = "iinfo --stats {}".format(input)
-        # start execute commond and console
-        output_log = execute_command(cmd, verbose=False, print_command=True)
-
-        lines_list = output_log.split("\n")
-        max_value = sys.float_info.max
-        for line in lines_list:
-            index = line.find("Stats Max:")
-            if index != -1:
-                # extract only numbers
-                # Stats Avg: 1.839321 1.951460 1.527444 1.000000 (float)
-                # => 1.839321 1.951460 1.527444 1.000000
-                s = line
-                max_values = s[s.find(": ") + 2: s.find("(") - 1].split(' ')
-                max_value = max(map(float, max_values))
-
-        cmd = "oiiotool -v {} --clamp:max={} --clamp:min=0 -o {}".format(input, max_value, output)
-        execute_command(cmd)
-
     def compress(self):
         sys.stdout.write("compressing ")
         for texture in self.config['textures']:
@@ -215,7 +193,7 @@ class ProcessEnvironment(object):
         size = self.mipmap_size
         nb_samples = self.nb_samples
         nb_levels = self.getMaxLevel(self.specular_size) - self.getMaxLevel(self.prefilter_stop_size)
-        filename = "/tmp/samplesGGX_{}_{}_{}.bin".format(nb_samples, size, nb_levels)
+        filename = "/tmp/samplesGGX_v1_{}_{}_{}.bin".format(nb_samples, size, nb_levels)
         if os.path.isfile(filename):
             return filename
 
@@ -261,20 +239,14 @@ class ProcessEnvironment(object):
         return max_level
 
     def cubemap_specular_create_mipmap(self, cubemap_size):
+        # the levels are made from the panorama by initBaseTexture
         max_level = self.getMaxLevel(cubemap_size)
-        previous_file = self.cubemap_highres
         self.mipmap_files = []
 
         for i in range(0, max_level + 1):
             size = int(math.pow(2, max_level - i))
             outout_filename = "/tmp/specular_{}.tif".format(i)
-            # remap size
-            cmd = "{} -p {} -n {} -i cube -o cube {} {}".format(
-                envremap_cmd, self.pattern_filter, size,
-                previous_file, outout_filename)
             self.mipmap_files.append({ "size": size, "filename": outout_filename })
-            previous_file = outout_filename
-            execute_command(cmd)
 
         self.mipmap_pattern = "/tmp/specular_%d.tif"
         file_basename = os.path.join(self.working_directory, self.mipmap_file_base)
@@ -343,10 +315,10 @@ class ProcessEnvironment(object):
                                       sample_file=self.sample_file)
         else:
             print "executing cpu prefiltering"
-            cmd = "{} -s {} -e {} -n {} -r {} {} {} {}".format(
+            cmd = "{} -s {} -e {} -n {} -r {} -c {} {} {} {}".format(
                 envPrefilter_cmd, specular_size, prefilter_stop_size,
-                self.nb_samples, self.sample_rotation, fix_flag, self.mipmap_pattern,
-                output_filename)
+                self.nb_samples, self.sample_rotation, self.sample_file, fix_flag,
+                self.mipmap_pattern, output_filename)
             execute_command(cmd)
 
     def specular_create_prefilter_panorama(self, specular_size, prefilter_stop_size):
@@ -481,29 +453,25 @@ class ProcessEnvironment(object):
             os.makedirs(self.working_directory)
 
         original_file = "/tmp/original_panorama.tif"
-        # clean source image
-        self.fix_source_environment(self.input_file, original_file)
-        self.panorama_highres = original_file
-
         cubemap_highres = "/tmp/highres_cubemap.tif"
-        # remap envmap to cube
-        cmd = "{} -p {} -o cube {} {}".format(envremap_cmd, self.pattern_filter, original_file, cubemap_highres)
+        cubemap_mipmap = "/tmp/specular_%d.tif"
+        # envremap reads the source directly and cleans its +inf/nan with -s,
+        # it writes the panorama at its size, the cube and the whole mipmap
+        # chain in one pass
+        cmd = "{} -s -p {} -o rect:0:{} -o cube:1024:{} -o cubemips:{}:{} {}".format(
+            envremap_cmd, self.pattern_filter, original_file, cubemap_highres,
+            self.mipmap_size, cubemap_mipmap, self.input_file)
         execute_command(cmd)
+        self.panorama_highres = original_file
 
         self.cubemap_highres = cubemap_highres
 
     def extract_lights(self):
 
-        # compute it one time for panorama
-        img_size_x = 1024
-        img_size_y = 512
-        # resize
-        panorama_smaller = os.path.join("/tmp/", "pano_small_{}.tif".format(img_size_x))
-        cmd = "oiiotool {} --resize {}x{} -o {}".format(
-            self.panorama_highres, img_size_x, img_size_y, panorama_smaller)
-        execute_command(cmd, verbose=False, print_command=True)
-
-        cmd = "{} {}".format(extractLights_cmd, panorama_smaller)
+        # the median cut is guided by a 1024 wide level of the panorama,
+        # extractLights finds its splits and lights at full resolution
+        cut_width = 1024
+        cmd = "{} -s {} {}".format(extractLights_cmd, cut_width, self.panorama_highres)
         output_log = execute_command(cmd, verbose=False, print_command=True)
         print output_log
         self.lights = output_log
@@ -559,6 +527,12 @@ class ProcessEnvironment(object):
         else:
             print "force computation on cpu"
 
+        if not self.prefilterGPU:
+            start_tick = time.time()
+            self.sample_file = self.create_sample_GGX()
+            print "== {} create_sample_GGX ==".format(time.time() - start_tick)
+            print ""
+
         # generate background
         start_tick = time.time()
         for size, blur in self.background_list:
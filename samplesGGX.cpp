@@ -4,9 +4,7 @@
 #include <iostream>
 
 #include "Cubemap"
-
-typedef unsigned int uint;
-typedef unsigned char ubyte;
+#include "PrecomputedLightTable"
 
 static int usage(const std::string& name) {
     std::cerr << "Usage: " << name << " outpufile nbsamples mip0Size nbSteps"
@@ -29,7 +27,10 @@ int main(int argc, char* argv[]) {
 
     float step = 1.0 / (nbSteps - 1.0);
 
-    FILE* file = fopen(output.c_str(), "wb");
+    std::vector<float> roughnessLevels;
+    std::vector<double> totalWeights;
+    std::vector<Vec4f> levelSamples;
+
     std::cout << "compute " << nbSteps << " levels sample GGX from roughness  "
               << step << " to 1.0" << std::endl;
     for (uint i = 1; i < nbSteps; i++) {
@@ -39,9 +40,16 @@ int main(int argc, char* argv[]) {
                   << std::endl;
         precomputedLightInLocalSpace(samples, roughnessLinear, mip0Size);
 
-        ubyte* buffer = (ubyte*)getPrecomputedLightCache();
-        fwrite(buffer, samples * 4 * 4, 1, file);
+        const Vec4f* buffer = getPrecomputedLightCache();
+        roughnessLevels.push_back(roughnessLinear);
+        totalWeights.push_back(getPrecomputedLightTotalWeight());
+        levelSamples.insert(levelSamples.end(), buffer, buffer + samples);
     }
 
+    if (!PrecomputedLightTable::write(output, samples, mip0Size,
+                                      roughnessLevels, totalWeights,
+                                      levelSamples))
+        return 1;
+
     return 0;
 }